@@ -0,0 +1,384 @@
+/* bench.c
+ *
+ * Desc:
+ * Synthetic-data benchmarks for todo.c. It generates todo.out
+ * files from 1k to 1M tasks and times loading, saving, the time
+ * frame queries, listing and the http renderer. Results are
+ * written to stdout as one JSON object per line.
+ *
+ * Allocations are counted by wrapping malloc & co at link time,
+ * see the bench target in the makefile. With -gen it only writes a
+ * synthetic list, used to train the pgo build.
+ *
+ * Author: Hugo Coto Florez
+ * Repo: https://github.com/hugootoflorez/todo
+ * License: licenseless
+ * Standard: C11
+ * ------------------------------------------------------*/
+
+#define TODO_NO_MAIN
+#include "todo.c"
+
+/* ---------- Allocation counters (-Wl,--wrap=...) ---------- */
+
+static size_t bench_allocs;
+static size_t bench_bytes;
+static bool bench_quiet = true;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *
+__wrap_malloc(size_t size)
+{
+        ++bench_allocs;
+        bench_bytes += size;
+        return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+        ++bench_allocs;
+        bench_bytes += nmemb * size;
+        return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+        ++bench_allocs;
+        bench_bytes += size;
+        return __real_realloc(ptr, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+        ++bench_allocs;
+        bench_bytes += strlen(s) + 1;
+        return __real_strdup(s);
+}
+
+/* ---------- Measurement ---------- */
+
+typedef struct {
+        uint64_t start_ns;
+        size_t allocs;
+        size_t bytes;
+} Bench_mark;
+
+static uint64_t
+now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static Bench_mark
+bench_start()
+{
+        return (Bench_mark) {
+                .start_ns = now_ns(),
+                .allocs = bench_allocs,
+                .bytes = bench_bytes,
+        };
+}
+
+/* Print one result line. REPS is the number of times the measured
+ * code ran over the N tasks since bench_start(). */
+static void
+bench_report(Bench_mark m, const char *name, int n, int reps)
+{
+        uint64_t elapsed = now_ns() - m.start_ns;
+        double per = (double) n * reps;
+
+        printf("{\"bench\":\"%s\",\"tasks\":%d,\"reps\":%d,"
+               "\"total_ns\":%" PRIu64 ",\"ns_per_task\":%.2f,"
+               "\"allocs_per_task\":%.3f,\"bytes_per_task\":%.1f}\n",
+               name, n, reps, elapsed, elapsed / per,
+               (bench_allocs - m.allocs) / per, (bench_bytes - m.bytes) / per);
+        fflush(stdout);
+}
+
+/* Repeat small workloads so the timer resolution does not dominate */
+static int
+bench_reps(int n)
+{
+        return n < 100000 ? 100000 / n : 1;
+}
+
+/* ---------- Synthetic data ---------- */
+
+/* Write N tasks due between 30 days ago and 60 days from now.
+ * Half of them have a description, one in 4 is tagged "work", one
+ * in 64 "ops" and one in 3 has a project. */
+static void
+gen_file(const char *filename, int n)
+{
+        FILE *f;
+        time_t now = time(NULL);
+
+        f = fopen(filename, "w");
+        assert(f);
+        for (int i = 0; i < n; i++) {
+                time_t due = now - 30 * 3600 * 24 + rand() % (90 * 3600 * 24);
+                fprintf(f, "[Task %d]\n", i);
+                fprintf(f, "  date: %s\n", overload_date(due));
+                if (i % 2)
+                        fprintf(f, "  desc: Synthetic description for task number %d\n", i);
+                if (i % 4 == 0 || i % 64 == 1)
+                        fprintf(f, "  tags: %s\n", i % 4 == 0 ? "work" : "ops");
+                if (i % 3 == 0)
+                        fprintf(f, "  project: %s\n", i % 2 ? "alpha" : "beta");
+                fprintf(f, "\n");
+        }
+        fclose(f);
+}
+
+/* ---------- Benchmarks ---------- */
+
+static void
+bench_query(const char *name, int n, time_t limit)
+{
+        int reps = bench_reps(n);
+        Bench_mark m = bench_start();
+        for (int i = 0; i < reps; i++) {
+                Task_view filter = tasks_before(*localtime(&limit));
+                view_destroy(&filter);
+        }
+        bench_report(m, name, n, reps);
+}
+
+/* Unsorted window count over the due column, e.g. how many tasks
+ * fall in the next week */
+static void
+bench_count(int n, time_t lo, time_t hi)
+{
+        int reps = bench_reps(n);
+        volatile int count;
+        Bench_mark m = bench_start();
+        for (int i = 0; i < reps; i++)
+                count = count_due_between(&data, lo, hi);
+        (void) count;
+        bench_report(m, "count_due_between/week", n, reps);
+}
+
+static void
+bench_search(int n)
+{
+        int reps = bench_reps(n);
+        Bench_mark m = bench_start();
+        search_attach(&data);
+        bench_report(m, "search_attach", n, 1);
+
+        m = bench_start();
+        for (int i = 0; i < reps; i++) {
+                Task_view found = search_query(&data, "task number 12");
+                view_destroy(&found);
+        }
+        bench_report(m, "search_query", n, reps);
+}
+
+static void
+bench_filter(int n, const char *expr)
+{
+        int reps = bench_reps(n);
+        struct due_range range;
+        char error[128];
+        Filter prog = { 0 };
+
+        Bench_mark m = bench_start();
+        for (int i = 0; i < reps; i++) {
+                assert(filter_compile(expr, &prog, &range, error, sizeof error));
+                Task_view found = filter_select(&data, &prog, range);
+                view_destroy(&found);
+                filter_destroy(&prog);
+        }
+        bench_report(m, "filter_select", n, reps);
+}
+
+/* "overdue AND tag:ops", a due range narrowed by a bitmap */
+static void
+bench_tags(int n)
+{
+        int reps = bench_reps(n);
+        uint32_t *tags = parse_tags("ops", false);
+        time_t now = time(NULL);
+
+        Bench_mark m = bench_start();
+        tag_index_attach(&data);
+        bench_report(m, "tag_index_attach", n, 1);
+
+        m = bench_start();
+        for (int i = 0; i < reps; i++) {
+                Task_view found = tasks_before(*localtime(&now));
+                view_filter_tags(&data, &found, tags, 0);
+                view_destroy(&found);
+        }
+        bench_report(m, "view_filter_tags/overdue+ops", n, reps);
+        free(tags);
+}
+
+static void
+bench_list(int n)
+{
+        int reps = bench_reps(n);
+        int fd = open("/dev/null", O_WRONLY);
+        assert(fd >= 0);
+
+        Task_view all = view_all(&data);
+        Bench_mark m = bench_start();
+        for (int i = 0; i < reps; i++)
+                list_tasks(fd, all, "Tasks");
+        bench_report(m, "list_tasks", n, reps);
+        view_destroy(&all);
+        close(fd);
+}
+
+static void *
+render_thread(void *args)
+{
+        return serve_gen_response(args);
+}
+
+/* Drive serve_gen_response through a socket pair, the same way
+ * the daemon does after accept(). The response is drained from
+ * this thread so big pages do not block the writer. */
+static void
+bench_render(int n)
+{
+        int reps = bench_reps(n);
+        struct serve_data *sdata;
+        const char req[] = "GET / HTTP/1.1\r\n\r\n";
+        char buf[64 * 1024];
+        pthread_t thread_id;
+        int sv[2];
+
+        Bench_mark m = bench_start();
+        for (int i = 0; i < reps; i++) {
+                assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+                assert(write(sv[1], req, sizeof req - 1) == sizeof req - 1);
+                /* Freed by serve_gen_response */
+                sdata = calloc(1, sizeof *sdata);
+                sdata->clientfd = sv[0];
+                assert(pthread_create(&thread_id, NULL, render_thread, sdata) == 0);
+                while (read(sv[1], buf, sizeof buf) > 0) {
+                }
+                pthread_join(thread_id, NULL);
+                close(sv[1]);
+        }
+        bench_report(m, "serve_gen_response", n, reps);
+}
+
+/* Export DATA to a .ics and a .csv file and import each into an empty
+ * store. DATA is left as it was. */
+static void
+bench_exchange(const char *dir, int n)
+{
+        const char *ext[] = { "ics", "csv" };
+        char file[256];
+        char name[64];
+        Task_store saved = data;
+
+        for (int i = 0; i < 2; i++) {
+                snprintf(file, sizeof file, "%stodo-bench-%d.%s", dir, n, ext[i]);
+                snprintf(name, sizeof name, "export_tasks/%s", ext[i]);
+                Bench_mark m = bench_start();
+                export_tasks(file);
+                bench_report(m, name, n, 1);
+
+                ZERO(&data);
+                snprintf(name, sizeof name, "import_tasks/%s", ext[i]);
+                m = bench_start();
+                import_tasks(file);
+                bench_report(m, name, n, 1);
+                store_destroy(&data);
+                data = saved;
+                unlink(file);
+        }
+}
+
+static void
+bench_size(const char *dir, int n, int render_max)
+{
+        char in[256];
+        char out[256];
+        time_t t;
+
+        snprintf(in, sizeof in, "%stodo-bench-%d.out", dir, n);
+        snprintf(out, sizeof out, "%stodo-bench-%d.save.out", dir, n);
+        gen_file(in, n);
+
+        Bench_mark m = bench_start();
+        load_from_file(in);
+        bench_report(m, "load_from_file", n, 1);
+
+        t = days(0);
+        bench_query("tasks_before/today", n, t);
+        t = next_sunday(NULL);
+        bench_query("tasks_before/week", n, t);
+        t = days(7);
+        bench_query("tasks_before/in7", n, t);
+        t = time(NULL);
+        bench_query("tasks_before/overdue", n, t);
+        bench_count(n, t, next_sunday(NULL));
+        bench_filter(n, "due < +3d and (desc ~ \"number 12\" or not name ~ 7)");
+
+        bench_tags(n);
+        bench_list(n);
+        bench_search(n);
+        bench_exchange(dir, n);
+
+        if (n <= render_max)
+                bench_render(n);
+
+        m = bench_start();
+        load_to_file(out);
+        bench_report(m, "load_to_file", n, 1);
+
+        destroy_all();
+        unlink(in);
+        unlink(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+        bool *help = flag_bool("help", false, "Print this help and exit");
+        int *min_tasks = flag_int("min_tasks", 1000, "Smallest synthetic list");
+        int *max_tasks = flag_int("max_tasks", 1000000, "Biggest synthetic list (x10 steps)");
+        int *render_max = flag_int("render_max", 100000, "Biggest list to render as html");
+        char **tmp_dir = flag_str("tmp_dir", TMP_PATH, "Directory (with trailing /) for synthetic files");
+        char **gen = flag_str("gen", NULL, "Only write a synthetic list of -max_tasks tasks to this file");
+        css_file = flag_str("css_file", "styles.css", "CSS file used by the renderer");
+        out_file = flag_str("out_file", "/dev/null", "File used by the Save button");
+        quiet = &bench_quiet;
+
+        srand(0);
+
+        if (!flag_parse(argc, argv)) {
+                usage(stderr);
+                flag_print_error(stderr);
+                exit(1);
+        }
+
+        if (*help) {
+                usage(stdout);
+                exit(0);
+        }
+
+        /* Training input for the pgo target */
+        if (*gen) {
+                gen_file(*gen, *max_tasks);
+                return 0;
+        }
+
+        for (int n = *min_tasks; n > 0 && n <= *max_tasks; n *= 10)
+                bench_size(*tmp_dir, n, *render_max);
+
+        return 0;
+}
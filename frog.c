@@ -5,14 +5,31 @@
 #define FLAGS "-Wall", "-Wextra"
 #define OUT "todo"
 
+/* Count allocations done by todo.c in the benchmarks. bench.c
+ * includes todo.c, so the daemon-only functions end up unused. */
+#define BENCH_FLAGS "-O2", "-Wno-unused-function", "-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup"
+
 
 int
 main(int argc, char *argv[])
 {
         frog_rebuild_itself(argc, argv);
+
+        /* ./frog bench: build the benchmarks and exit */
+        if (argc > 1 && !strcmp(argv[1], "bench")) {
+                frog_cmd_wait(CC, FLAGS, BENCH_FLAGS, "bench.c", "-o", "bench", NULL);
+                return 0;
+        }
+
+        /* ./frog pgo: LTO + profile guided todo, see pgo.sh */
+        if (argc > 1 && !strcmp(argv[1], "pgo")) {
+                frog_cmd_wait(CC, FLAGS, BENCH_FLAGS, "bench.c", "-o", "bench", NULL);
+                frog_shell_cmd("./pgo.sh");
+                return 0;
+        }
+
         frog_cmd_wait(CC, FLAGS, "todo.c", "-o", OUT, NULL);
         frog_shell_cmd("cp ./todo ~/.local/bin/todo");
 
         return 0;
 }
-
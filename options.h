@@ -9,14 +9,36 @@
 #define CSS_FILENAME BACKUP_PATH CSS_PATH "styles.css"
 #define LOG_FILENAME BACKUP_PATH HIDEN "log.txt"
 #define PID_FILENAME TMP_PATH "todo-daemon-pid"
+#define SHM_NAME "/todo_store" /* tasks published by the daemon */
+#define BENCH_FILENAME TMP_PATH "todo-bench-serve.out"
+#define ARCHIVE_FILENAME BACKUP_PATH "todo.archive"
+#define BENCH_ARCHIVE_FILENAME TMP_PATH "todo-bench-serve.archive"
+#define UNDO_FILENAME BACKUP_PATH HIDEN "todo.undo"
+#define BENCH_UNDO_FILENAME TMP_PATH "todo-bench-serve.undo"
 
 #define PORT 5002
 #define MAX_ATTEMPTS 10
 #define MAX_CLIENTS 16
+#define IDLE_TIMEOUT 10     /* seconds a client may take to send a request */
 #define BUFSIZE 1024 * 1024 /* IO buffer */
+#define ARCHIVE_BLOCK 4096  /* done tasks per archive block */
+#define ARCHIVE_COMPACT 16  /* short archive blocks kept before a rewrite */
+#define UNDO_DEPTH 64       /* changes kept by the undo log */
+#define LOAD_THREADS 16     /* most threads parsing the task file */
+#define LOAD_CHUNK (1 << 20) /* least bytes parsed by each of them */
+#define PAGE_SIZE 100       /* tasks per web page */
+#define RENDER_CACHE 32     /* pages kept by each daemon acceptor */
+#define REPEAT_MAX 366      /* occurrences of a repeating task per view */
 
 /* Please note that modifying this macro would break all previously
  * loaded tasks. As tasks are not modificable, changing this variable
  * invalidates all yet created tasks. It can be modified if needed. */
 #define DATETIME_FORMAT "%c"
 #define DATETIME_MAXLEN 64
+
+/* How due dates are saved in the task file. Files in any of them are
+ * loaded, so it can be changed at any time.
+ *   DATE_LOCALE   DATETIME_FORMAT, the most readable
+ *   DATE_ISO8601  2026-10-19T14:03:00+0200, the fastest to load
+ *   DATE_EPOCH    seconds since 1970 */
+#define DATE_ENCODING DATE_LOCALE
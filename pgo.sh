@@ -0,0 +1,97 @@
+#!/bin/sh
+# pgo.sh
+#
+# Desc:
+# Build todo with LTO and profile guided optimization. ./bench -gen
+# writes a synthetic list, an instrumented build runs the training
+# workload over it and the profile is used for the final ./todo.
+# The CLI part of the workload is timed with a plain -O2 -flto build
+# and with the PGO one, so it shows whether the result is faster.
+#
+# Every file lives in a temporary directory. The task file, archive
+# and undo log of options.h are not touched and no daemon is started
+# (-bench-serve stops its own).
+#
+# Usage: ./pgo.sh (or make pgo). TASKS and CC can be overridden.
+# ------------------------------------------------------
+
+set -e
+
+CC=${CC:-gcc}
+TASKS=${TASKS:-100000}
+FLAGS="-Wall -Wextra -std=c11 -O2 -flto=auto"
+DIR=$(mktemp -d /tmp/todo-pgo.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+
+now_ms() {
+        echo $(($(date +%s%N) / 1000000))
+}
+
+# One run of the CLI workload with the binary $1: listings, time
+# frames, filters, search, tags, export and import, and a done and its
+# undo. DIR has no spaces, so the arguments are split.
+train() {
+        todo=$1
+        files="-archive_file $DIR/archive -undo_file $DIR/undo -css_file styles.css"
+        tasks="-in_file $DIR/tasks.out -out_file $DIR/tasks.out $files"
+        imported="-in_file $DIR/empty.out -out_file $DIR/imported.out $files"
+
+        cp "$DIR/train.out" "$DIR/tasks.out"
+        : > "$DIR/empty.out"
+        rm -f "$DIR/archive" "$DIR/undo"
+
+        "$todo" $tasks > /dev/null
+        "$todo" $tasks -today > /dev/null
+        "$todo" $tasks -week > /dev/null
+        "$todo" $tasks -month > /dev/null
+        "$todo" $tasks -in 7 > /dev/null
+        "$todo" $tasks -overdue -tag work > /dev/null
+        "$todo" $tasks -filter 'due < +3d and (desc ~ "number 12" or not name ~ 7)' > /dev/null
+        "$todo" $tasks -search 'task number 12' > /dev/null
+        "$todo" $tasks -export "$DIR/tasks.ics" -quiet
+        "$todo" $tasks -export "$DIR/tasks.csv" -quiet
+        "$todo" $imported -import "$DIR/tasks.ics" -quiet > /dev/null
+        "$todo" $imported -import "$DIR/tasks.csv" -quiet > /dev/null
+        "$todo" $tasks -done 0 > /dev/null
+        "$todo" $tasks -undo > /dev/null
+}
+
+# Best of 3 runs, in ms
+time_train() {
+        best=
+        for run in 1 2 3; do
+                start=$(now_ms)
+                train "$1"
+                ms=$(($(now_ms) - start))
+                if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+                        best=$ms
+                fi
+        done
+        echo "$best"
+}
+
+./bench -gen "$DIR/train.out" -max_tasks "$TASKS"
+
+# Both builds compile to the same object name, so -fprofile-use finds
+# the .gcda files written by the instrumented one
+$CC $FLAGS -c todo.c -o "$DIR/todo.o"
+$CC $FLAGS "$DIR/todo.o" -o "$DIR/todo-lto"
+
+$CC $FLAGS -fprofile-generate="$DIR/profile" -fprofile-update=prefer-atomic -c todo.c -o "$DIR/todo.o"
+$CC $FLAGS -fprofile-generate="$DIR/profile" "$DIR/todo.o" -o "$DIR/todo-gen"
+train "$DIR/todo-gen"
+# The http renderer is trained but not timed, the load generator
+# mostly waits on sockets
+"$DIR/todo-gen" -in_file "$DIR/tasks.out" -css_file styles.css \
+        -bench-serve -bench-tasks 10000 -bench-requests 2000 > /dev/null
+
+$CC $FLAGS -fprofile-use="$DIR/profile" -fprofile-partial-training -c todo.c -o "$DIR/todo.o"
+$CC $FLAGS -fprofile-use="$DIR/profile" "$DIR/todo.o" -o "$DIR/todo-pgo"
+
+before=$(time_train "$DIR/todo-lto")
+after=$(time_train "$DIR/todo-pgo")
+cp "$DIR/todo-pgo" todo
+
+echo "CLI workload ($TASKS tasks, best of 3):"
+echo "  -O2 -flto:       $before ms"
+echo "  -O2 -flto + PGO: $after ms"
@@ -15,26 +15,54 @@
  * and greater to 499 to use strdup */
 #define _XOPEN_SOURCE 500
 #define _POSIX_C_SOURCE 200809L
+/* syscall(), for io_uring */
+#define _DEFAULT_SOURCE
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* -uring needs the Linux 5.19 interface, older headers build without */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IOSQE_CQE_SKIP_SUCCESS) && defined(IORING_SETUP_COOP_TASKRUN)
+#define HAVE_IO_URING
+#endif
+
 #define FLAG_IMPLEMENTATION
 #include "flag.h"
 
@@ -50,15 +78,74 @@
         } while (0)
 
 
+/* EVERY is how the task repeats: 0 never, N > 0 every N days,
+ * -N every N months. DUE is the next pending occurrence.
+ * PROJECT (0 for none) and TAGS (NULL or 0 terminated, sorted) are
+ * symbols, see intern(). */
 typedef struct {
         time_t due;
         char *name;
         char *desc;
+        int every;
+        uint32_t project;
+        uint32_t *tags;
 } Task;
 
-typedef DA(Task) Task_da;
+struct search_index;
+struct tag_index;
+
+/* Tasks are kept column by column so scans over due dates only walk
+ * the dense DUE column. Row I is (due[i], name[i], desc[i]). DATA is
+ * kept sorted by due date, so row numbers are the indices printed by
+ * list_tasks and used by -done.
+ * Rows move when tasks are inserted or removed; ID[i] is a key that
+ * stays the same for the whole run (it is not saved to the file). */
+typedef struct {
+        time_t *due;
+        char **name;
+        char **desc;
+        int *every;
+        uint32_t *project;
+        uint32_t **tags;
+        uint32_t *id;
+        int size;
+        int capacity;
+
+        uint32_t next_id;
+        int *row_of; /* id -> row, rebuilt when ROW_OF_DIRTY */
+        bool row_of_dirty;
+        bool dirty; /* changed since it was loaded or saved */
+        struct search_index *search; /* kept up to date if not NULL */
+        struct tag_index *tag_index; /* kept up to date if not NULL */
+} Task_store;
+
+/* A subset of the rows of a store, in due date order. If DUE is not
+ * NULL, entry I is the occurrence of a repeating task due at DUE[i],
+ * and the same row may show up more than once. */
+typedef struct {
+        int *rows;
+        time_t *due;
+        int size;
+} Task_view;
+
+/* What changed the tasks, see the undo log */
+typedef enum {
+        UNDO_ADD = 0,
+        UNDO_DONE,
+        UNDO_CLEAR,
+        UNDO_IMPORT,
+} Undo_kind;
 
-Task_da data;
+typedef enum {
+        UNDO_INSERT = 0,
+        UNDO_REMOVE,
+} Undo_op;
+
+#define TIME_MIN ((time_t) (sizeof(time_t) == 8 ? INT64_MIN : INT32_MIN))
+#define TIME_MAX ((time_t) (sizeof(time_t) == 8 ? INT64_MAX : INT32_MAX))
+
+Task_store data;
+char **in_file;
 char **out_file;
 char **css_file;
 bool *quiet = NULL;
@@ -76,6 +163,223 @@ const char *no_tasks_messages[] = {
         "You're ahead of schedule! Keep up the great work."
 };
 
+static uint64_t
+monotonic_us()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* ---------- Chrome trace events (-trace) ---------- */
+
+/* Events are written as soon as they end, one per line, so the daemon
+ * can keep appending to the file. chrome://tracing and Perfetto accept
+ * the array without the closing bracket when it is killed. */
+static int trace_fd = -1;
+static int trace_next_tid;
+static _Thread_local int trace_tid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+trace_open(const char *filename)
+{
+        trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (trace_fd < 0) {
+                LOG("File %s can not be opened to write!\n", filename);
+                return;
+        }
+        dprintf(trace_fd, "[\n");
+}
+
+/* Complete event NAME that started at START (monotonic_us) and lasted
+ * DUR microseconds. ARGS is a JSON object or NULL. */
+static void
+trace_event(const char *name, uint64_t start, uint64_t dur, const char *args)
+{
+        char buf[256];
+        char escaped[128];
+        char *line = buf;
+        size_t k = 0;
+        int n;
+
+        if (trace_fd < 0)
+                return;
+
+        if (trace_tid == 0)
+                trace_tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+
+        /* NAME as a JSON string, control characters are dropped */
+        for (; *name && k < sizeof escaped - 2; name++) {
+                if (*name == '"' || *name == '\\')
+                        escaped[k++] = '\\';
+                if ((unsigned char) *name >= ' ')
+                        escaped[k++] = *name;
+        }
+        escaped[k] = 0;
+
+#define TRACE_LINE(buf, size)                                                                         \
+        snprintf((buf), (size),                                                                       \
+                 "{\"name\":\"%s\",\"cat\":\"todo\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"                   \
+                 "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"args\":%s},\n",                                 \
+                 escaped, (int) getpid(), trace_tid, start, dur, args ? args : "{}")
+        n = TRACE_LINE(buf, sizeof buf);
+        /* Long ARGS do not fit, the event is not cut */
+        if (n >= (int) sizeof buf) {
+                line = malloc(n + 1);
+                assert(line);
+                n = TRACE_LINE(line, n + 1);
+        }
+#undef TRACE_LINE
+
+        pthread_mutex_lock(&trace_lock);
+        if (write(trace_fd, line, n) != n)
+                LOG("Trace: write failed: %s\n", strerror(errno));
+        pthread_mutex_unlock(&trace_lock);
+        if (line != buf)
+                free(line);
+}
+
+#define TRACE_END(name, start) trace_event((name), (start), monotonic_us() - (start), NULL)
+
+static void
+trace_close()
+{
+        if (trace_fd < 0)
+                return;
+        dprintf(trace_fd, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                          "\"args\":{\"name\":\"todo\"}}\n]\n",
+                (int) getpid());
+        close(trace_fd);
+        trace_fd = -1;
+}
+
+/* ---------- Buffered output ---------- */
+
+/* Growable output buffer shared by the task listing, the save path and
+ * the http renderer. With FD >= 0 it is written out every OUTBUF_FLUSH
+ * bytes and by ob_flush(); with FD < 0 it only grows and the caller
+ * sends DATA itself. ERROR is the errno of the first failed write:
+ * the automatic flushes can not report it, so it sticks and callers
+ * check it once at the end. */
+typedef struct {
+        char *data;
+        size_t size;
+        size_t capacity;
+        int fd;
+        int error;
+} Outbuf;
+
+#define OUTBUF_FLUSH (64 * 1024)
+
+/* Write all COUNT buffers, retrying on short writes */
+static int
+writev_all(int fd, struct iovec *iov, int count)
+{
+        ssize_t n;
+
+        while (count > 0) {
+                if ((n = writev(fd, iov, count)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                while (count > 0 && (size_t) n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        ++iov;
+                        --count;
+                }
+                if (count > 0) {
+                        iov->iov_base = (char *) iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+        return 0;
+}
+
+/* Write out DATA. Returns -1 if this or an earlier write failed, the
+ * output is then incomplete and nothing more is written. */
+static int
+ob_flush(Outbuf *ob)
+{
+        struct iovec iov = { .iov_base = ob->data, .iov_len = ob->size };
+
+        if (ob->fd < 0 || ob->size == 0)
+                return ob->error ? -1 : 0;
+        ob->size = 0;
+        if (!ob->error && writev_all(ob->fd, &iov, 1) < 0)
+                ob->error = errno ? errno : EIO;
+        return ob->error ? -1 : 0;
+}
+
+static void
+ob_reserve(Outbuf *ob, size_t n)
+{
+        if (ob->size + n + 1 <= ob->capacity)
+                return;
+        if (ob->capacity == 0)
+                ob->capacity = 4096;
+        while (ob->size + n + 1 > ob->capacity)
+                ob->capacity *= 2;
+        ob->data = realloc(ob->data, ob->capacity);
+        assert(ob->data);
+}
+
+static void
+ob_write(Outbuf *ob, const char *str, size_t n)
+{
+        ob_reserve(ob, n);
+        memcpy(ob->data + ob->size, str, n);
+        ob->size += n;
+        ob->data[ob->size] = 0;
+        if (ob->fd >= 0 && ob->size >= OUTBUF_FLUSH)
+                ob_flush(ob);
+}
+
+#define ob_puts(ob, str) ob_write((ob), (str), strlen(str))
+
+static void
+ob_vprintf(Outbuf *ob, const char *format, va_list arg)
+{
+        va_list arg2;
+        int n;
+
+        va_copy(arg2, arg);
+        ob_reserve(ob, 0);
+        n = vsnprintf(ob->data + ob->size, ob->capacity - ob->size, format, arg);
+        if ((size_t) n >= ob->capacity - ob->size) {
+                ob_reserve(ob, n);
+                vsnprintf(ob->data + ob->size, ob->capacity - ob->size, format, arg2);
+        }
+        va_end(arg2);
+        ob->size += n;
+        if (ob->fd >= 0 && ob->size >= OUTBUF_FLUSH)
+                ob_flush(ob);
+}
+
+static void
+ob_printf(Outbuf *ob, const char *format, ...)
+{
+        va_list arg;
+        va_start(arg, format);
+        ob_vprintf(ob, format, arg);
+        va_end(arg);
+}
+
+static void
+ob_destroy(Outbuf *ob)
+{
+        free(ob->data);
+        ZERO(ob);
+}
+
+/* DATE_ENCODING values, see options.h */
+enum {
+        DATE_LOCALE = 0,
+        DATE_ISO8601,
+        DATE_EPOCH,
+};
+
 static char *
 overload_date(time_t time)
 {
@@ -84,423 +388,6546 @@ overload_date(time_t time)
         return global_datetime_buffer;
 }
 
-static int
-compare_tasks_by_date(const void *a, const void *b)
+/* timegm(), which is not POSIX. Days from civil by H. Hinnant. */
+static time_t
+utc_mktime(const struct tm *tp)
 {
-        Task *ea = (Task *) a;
-        Task *eb = (Task *) b;
-        return (int) (ea->due - eb->due);
+        int m = tp->tm_mon + 1;
+        long long y = tp->tm_year + 1900 - (m <= 2);
+        long long era = (y >= 0 ? y : y - 399) / 400;
+        long long yoe = y - era * 400;
+        long long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + tp->tm_mday - 1;
+        long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return (era * 146097 + doe - 719468) * 86400 + tp->tm_hour * 3600 + tp->tm_min * 60 + tp->tm_sec;
 }
 
-static inline void
-add_if_valid(Task task)
+/* mktime() with the UTC offset of the last local half hour (zones
+ * like Australia/Lord_Howe move 30 minutes) it was asked for cached
+ * by each thread. mktime() takes a global lock and looks up the zone
+ * rules on every call, and due dates come sorted, so most dates fall
+ * in a half hour already seen. */
+static time_t
+local_mktime(struct tm *tp)
+{
+        static _Thread_local struct {
+                long long slot;
+                time_t offset;
+                bool valid;
+        } cache;
+        struct tm copy = *tp;
+        long long slot = (((tp->tm_year * 12LL + tp->tm_mon) * 32 + tp->tm_mday) * 24 + tp->tm_hour) * 2 + (tp->tm_min >= 30);
+        bool normal = tp->tm_mon >= 0 && tp->tm_mon < 12 && tp->tm_mday >= 1 && tp->tm_mday <= 31 &&
+                      tp->tm_hour >= 0 && tp->tm_hour < 24 && tp->tm_min >= 0 && tp->tm_min < 60 &&
+                      tp->tm_sec >= 0 && tp->tm_sec <= 60;
+        time_t t;
+
+        if (normal && cache.valid && cache.slot == slot)
+                return utc_mktime(tp) - cache.offset;
+
+        copy.tm_isdst = -1; // determine if summer time is in use (+-1h)
+        t = mktime(&copy);
+        if (normal && t != (time_t) -1) {
+                cache.slot = slot;
+                cache.offset = utc_mktime(tp) - t;
+                cache.valid = true;
+        }
+        return t;
+}
+
+/* Parse the N digits at STR */
+static bool
+parse_digits(const char *str, int n, int *out)
 {
-        if (task.name && task.due) {
-                da_append(&data, task);
+        *out = 0;
+        for (int i = 0; i < n; i++) {
+                if (!isdigit((unsigned char) str[i]))
+                        return false;
+                *out = *out * 10 + str[i] - '0';
         }
+        return true;
 }
 
-static void
-list_tasks(int fd, Task_da d, const char *format, ...)
+/* "2026-10-19T14:03:00" and a "+0200", "+02:00" or "Z" UTC offset, as
+ * written with DATE_ISO8601. Without an offset it is local time. */
+static bool
+parse_due_iso(const char *str, time_t *t)
 {
-        va_list arg;
-        va_start(arg, format);
-        qsort(d.data, d.size, sizeof *d.data, compare_tasks_by_date);
+        struct tm tp = { 0 };
+        int oh, om;
+        int sign;
 
-        if (!*quiet) {
-                vdprintf(fd, format, arg);
-                dprintf(fd, ":\n");
+        if (!parse_digits(str, 4, &tp.tm_year) || str[4] != '-' || !parse_digits(str + 5, 2, &tp.tm_mon) ||
+            str[7] != '-' || !parse_digits(str + 8, 2, &tp.tm_mday) || str[10] != 'T' ||
+            !parse_digits(str + 11, 2, &tp.tm_hour) || str[13] != ':' || !parse_digits(str + 14, 2, &tp.tm_min) ||
+            str[16] != ':' || !parse_digits(str + 17, 2, &tp.tm_sec))
+                return false;
+        tp.tm_year -= 1900;
+        tp.tm_mon -= 1;
+        str += 19;
+        if (*str == 0) {
+                *t = local_mktime(&tp);
+                return true;
         }
-        for_da_each(e, d)
-        {
-                dprintf(fd, "%d: %s (%s)", da_index(e, d), e->name, overload_date(e->due));
-                dprintf(fd, e->desc ? ": %s\n" : "\n", e->desc);
+        if (*str == 'Z' && str[1] == 0) {
+                *t = utc_mktime(&tp);
+                return true;
         }
-        if (d.size == 0 && !*quiet)
-                dprintf(fd, "  %s\n", no_tasks_messages[rand() % 10]);
+        if ((*str != '+' && *str != '-') || !parse_digits(str + 1, 2, &oh))
+                return false;
+        sign = *str == '-' ? -1 : 1;
+        str += 3;
+        if (*str == ':')
+                ++str;
+        if (!parse_digits(str, 2, &om) || str[2])
+                return false;
+        *t = utc_mktime(&tp) - sign * (oh * 3600 + om * 60);
+        return true;
 }
 
-static int
-load_from_file(const char *filename)
+/* "Mon Oct 19 14:03:00 2026", what %c gives in the C locale */
+static bool
+parse_due_c(const char *str, time_t *t)
+{
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        struct tm tp = { 0 };
+        const char *m;
+
+        if (strlen(str) != 24 || str[3] != ' ' || str[7] != ' ' || str[10] != ' ')
+                return false;
+        for (m = months; *m && strncmp(m, str + 4, 3); m += 3)
+                ;
+        if (!*m)
+                return false;
+        tp.tm_mon = (m - months) / 3;
+        if (!parse_digits(str + 8 + (str[8] == ' '), 2 - (str[8] == ' '), &tp.tm_mday) ||
+            !parse_digits(str + 11, 2, &tp.tm_hour) || str[13] != ':' || !parse_digits(str + 14, 2, &tp.tm_min) ||
+            str[16] != ':' || !parse_digits(str + 17, 2, &tp.tm_sec) || str[19] != ' ' ||
+            !parse_digits(str + 20, 4, &tp.tm_year))
+                return false;
+        tp.tm_year -= 1900;
+        *t = local_mktime(&tp);
+        return true;
+}
+
+/* Due date of a task file "  date: " line in any DATE_ENCODING */
+static time_t
+parse_due(const char *str)
 {
-        FILE *f;
-        char buf[128];
-        Task task = { 0 };
         struct tm tp;
+        time_t t;
         char *c;
 
-        f = fopen(filename, "r");
-        if (f == NULL) {
-                LOG("File %s can not be opened! You should create it\n", filename);
-                return 0;
+        if (isdigit((unsigned char) *str)) {
+                if (parse_due_iso(str, &t))
+                        return t;
+                t = strtoll(str, &c, 10);
+                if (*c == 0)
+                        return t;
         }
+        /* The program never calls setlocale(), %c is the C one */
+        if (strcmp(DATETIME_FORMAT, "%c") == 0 && parse_due_c(str, &t))
+                return t;
 
-        while (fgets(buf, sizeof buf - 1, f)) {
-                switch (buf[0]) {
-                        /* NAME */
-                case '[':
-                        add_if_valid(task);
-                        ZERO(&task);
-                        TRUNCAT(buf, ']');
-                        task.name = strdup(buf + 1);
-                        break;
+        ZERO(&tp);
+        if ((c = strptime(str, DATETIME_FORMAT, &tp)) && *c) {
+                LOG("Can not load %s\n", str);
+        }
+        return local_mktime(&tp);
+}
 
-                        /* DESCRIPTION */
-                case ' ':
-                        if (!memcmp(buf + 2, "desc: ", 6)) {
-                                TRUNCAT(buf + 8, '\n');
-                                task.desc = strdup(buf + 8);
-                        }
+/* Due date as written to the task file */
+static char *
+format_due(time_t time)
+{
+        static char buf[DATETIME_MAXLEN];
+        struct tm tp;
 
-                        /* DATE TIME */
-                        else if (!memcmp(buf + 2, "date: ", 6)) {
-                                TRUNCAT(buf, '\n');
-                                ZERO(&tp);
-                                if ((c = strptime(buf + 8, DATETIME_FORMAT, &tp)) && *c) {
-                                        LOG("Can not load %s\n", buf + 8);
-                                }
+        switch (DATE_ENCODING) {
+        case DATE_EPOCH:
+                snprintf(buf, sizeof buf, "%lld", (long long) time);
+                return buf;
+        case DATE_ISO8601:
+                strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%S%z", localtime_r(&time, &tp));
+                return buf;
+        default:
+                return overload_date(time);
+        }
+}
 
-                                tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
-                                task.due = mktime(&tp);
-                        }
+/* ---------- Task store ---------- */
 
-                        /* INVALID ARGUMENT */
-                        else
-                                LOG("Unknown token: %s\n", buf);
-                        break;
+/* Every column of Task_store, with one element per row */
+#define STORE_COLUMNS(X) \
+        X(due)           \
+        X(name)          \
+        X(desc)          \
+        X(every)         \
+        X(project)       \
+        X(tags)          \
+        X(id)
 
-                case '\n':
-                        break;
-                default:
-                        LOG("Unknown token: %s\n", buf);
-                        break;
-                }
-        }
+static void
+store_reserve(Task_store *s, int n)
+{
+        if (s->size + n <= s->capacity)
+                return;
+        if (s->capacity == 0)
+                s->capacity = 64;
+        while (s->size + n > s->capacity)
+                s->capacity *= 2;
+#define X(col)                                                       \
+        s->col = realloc(s->col, s->capacity * sizeof *s->col); \
+        assert(s->col);
+        STORE_COLUMNS(X)
+#undef X
+}
 
-        add_if_valid(task);
-        fclose(f);
-        return 1;
+static inline Task
+store_get(Task_store *s, int row)
+{
+        return (Task) {
+                .due = s->due[row],
+                .name = s->name[row],
+                .desc = s->desc[row],
+                .every = s->every[row],
+                .project = s->project[row],
+                .tags = s->tags[row],
+        };
 }
 
-static int
-load_to_file(const char *filename)
+static inline void
+store_set(Task_store *s, int row, Task task)
 {
-        FILE *f;
-        f = fopen(filename, "w");
+        s->due[row] = task.due;
+        s->name[row] = task.name;
+        s->desc[row] = task.desc;
+        s->every[row] = task.every;
+        s->project[row] = task.project;
+        s->tags[row] = task.tags;
+}
 
-        if (f == NULL) {
-                LOG("File %s can not be opened to write!\n", filename);
-                return 0;
-        }
+static void
+task_free(Task task)
+{
+        free(task.name);
+        free(task.desc);
+        free(task.tags);
+}
 
-        for_da_each(task, data)
-        {
-                fprintf(f, "[%s]\n", task->name);
-                fprintf(f, "  date: %s\n", overload_date(task->due));
-                if (task->desc)
-                        fprintf(f, "  desc: %s\n", task->desc);
-                fprintf(f, "\n");
+static void search_add(struct search_index *idx, uint32_t id, Task task);
+static void search_remove(struct search_index *idx, uint32_t id, Task task);
+static void search_destroy(struct search_index *idx);
+static void tag_index_add(struct tag_index *idx, uint32_t id, Task task);
+static void tag_index_remove(struct tag_index *idx, uint32_t id, Task task);
+static void tag_index_destroy(struct tag_index *idx);
+
+/* Give ROW a new id and index it */
+static void
+store_new_id(Task_store *s, int row)
+{
+        s->id[row] = s->next_id++;
+        s->row_of_dirty = true;
+        s->dirty = true;
+        if (s->search)
+                search_add(s->search, s->id[row], store_get(s, row));
+        if (s->tag_index)
+                tag_index_add(s->tag_index, s->id[row], store_get(s, row));
+}
+
+/* Append TASK without keeping the order, call store_sort() after */
+static void
+store_append(Task_store *s, Task task)
+{
+        store_reserve(s, 1);
+        store_set(s, s->size++, task);
+        store_new_id(s, s->size - 1);
+}
+
+/* Move rows [ROW, size) N positions (N < 0 to the left) */
+static void
+store_shift(Task_store *s, int row, int n)
+{
+        int count = s->size - row;
+#define X(col) memmove(s->col + row + n, s->col + row, count * sizeof *s->col);
+        STORE_COLUMNS(X)
+#undef X
+        s->row_of_dirty = true;
+}
+
+/* First row whose due date is greater than DUE */
+static int
+store_upper_bound(Task_store *s, time_t due)
+{
+        int lo = 0;
+        int hi = s->size;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (s->due[mid] <= due)
+                        lo = mid + 1;
+                else
+                        hi = mid;
         }
+        return lo;
+}
 
-        fclose(f);
-        return data.size;
+/* Insert TASK keeping the store sorted. Returns its row. */
+static int
+store_insert(Task_store *s, Task task)
+{
+        int row = store_upper_bound(s, task.due);
+        store_reserve(s, 1);
+        store_shift(s, row, 1);
+        ++s->size;
+        store_set(s, row, task);
+        store_new_id(s, row);
+        return row;
+}
+
+/* Remove ROW and return it, the caller owns its strings */
+static Task
+store_take(Task_store *s, int row)
+{
+        Task task = store_get(s, row);
+        if (s->search)
+                search_remove(s->search, s->id[row], task);
+        if (s->tag_index)
+                tag_index_remove(s->tag_index, s->id[row], task);
+        store_shift(s, row + 1, -1);
+        --s->size;
+        s->dirty = true;
+        return task;
 }
 
+/* Remove and free ROW */
 static void
-kill_self()
+store_remove(Task_store *s, int row)
 {
-        static sem_t *sem = NULL;
-        pid_t pid;
-        int fd;
+        if (row < 0 || row >= s->size)
+                return;
+        task_free(store_take(s, row));
+}
 
-        if (!sem) {
-                sem = sem_open("/todo_pid_file_sem", O_CREAT, 0600, 1);
+static void
+store_clear(Task_store *s)
+{
+        while (s->size > 0)
+                store_remove(s, s->size - 1);
+}
+
+static void
+store_destroy(Task_store *s)
+{
+        for (int i = 0; i < s->size; i++)
+                task_free(store_get(s, i));
+        if (s->search)
+                search_destroy(s->search);
+        if (s->tag_index)
+                tag_index_destroy(s->tag_index);
+#define X(col) free(s->col);
+        STORE_COLUMNS(X)
+#undef X
+        free(s->row_of);
+        ZERO(s);
+}
+
+/* Current row of task ID, or -1 if it was removed */
+static int
+store_row_of(Task_store *s, uint32_t id)
+{
+        if (s->row_of_dirty || !s->row_of) {
+                s->row_of = realloc(s->row_of, (s->next_id + 1) * sizeof *s->row_of);
+                assert(s->row_of);
+                memset(s->row_of, 0xff, (s->next_id + 1) * sizeof *s->row_of);
+                for (int i = 0; i < s->size; i++)
+                        s->row_of[s->id[i]] = i;
+                s->row_of_dirty = false;
         }
-        assert(sem != SEM_FAILED);
+        return id < s->next_id ? s->row_of[id] : -1;
+}
 
-        sem_wait(sem);
+struct sort_key {
+        time_t due;
+        int row;
+};
 
-        fd = open(PID_FILENAME, O_RDONLY | O_CREAT, 0600);
-        assert(fd >= 0);
-        while (read(fd, &pid, sizeof pid) == sizeof pid) {
-                kill(pid, SIGTERM);
+static int
+compare_sort_keys(const void *a, const void *b)
+{
+        const struct sort_key *ea = a;
+        const struct sort_key *eb = b;
+        if (ea->due != eb->due)
+                return ea->due < eb->due ? -1 : 1;
+        return ea->row - eb->row;
+}
+
+/* Reorder the N elements of SIZE bytes of COL as in KEYS. TMP must
+ * hold N elements. */
+static void
+permute_column(void *col, size_t size, const struct sort_key *keys, int n, void *tmp)
+{
+        for (int i = 0; i < n; i++)
+                memcpy((char *) tmp + i * size, (char *) col + keys[i].row * size, size);
+        memcpy(col, tmp, n * size);
+}
+
+/* Sort by due date (stable). Only the keys are sorted, then each column
+ * is permuted once. Rows are usually appended to a sorted store (a
+ * saved file, an import), so the sorted prefix is kept and only the
+ * rest is sorted and merged into it. */
+static void
+store_sort(Task_store *s)
+{
+        uint64_t start = monotonic_us();
+        struct sort_key *keys;
+        struct sort_key *merged;
+        void *tmp;
+        int sorted = 1;
+
+        while (sorted < s->size && s->due[sorted - 1] <= s->due[sorted])
+                ++sorted;
+        if (sorted >= s->size)
+                return;
+
+        keys = malloc(s->size * sizeof *keys);
+        merged = malloc(s->size * sizeof *merged);
+        tmp = malloc(s->size * sizeof(uint64_t));
+        assert(keys && merged && tmp);
+
+        for (int i = 0; i < s->size; i++)
+                keys[i] = (struct sort_key) { .due = s->due[i], .row = i };
+        qsort(keys + sorted, s->size - sorted, sizeof *keys, compare_sort_keys);
+
+        /* On ties the prefix goes first, it has the lower rows */
+        for (int i = 0, j = sorted, k = 0; k < s->size; k++) {
+                if (j == s->size || (i < sorted && keys[i].due <= keys[j].due))
+                        merged[k] = keys[i++];
+                else
+                        merged[k] = keys[j++];
         }
-        close(fd);
 
-        fd = open(PID_FILENAME, O_WRONLY | O_TRUNC | O_CREAT, 0600);
-        assert(fd >= 0);
-        pid = getpid();
-        assert(write(fd, &pid, sizeof pid) == sizeof pid);
-        close(fd);
+#define X(col)                                                 \
+        static_assert(sizeof *s->col <= sizeof(uint64_t), ""); \
+        permute_column(s->col, sizeof *s->col, merged, s->size, tmp);
+        STORE_COLUMNS(X)
+#undef X
+        s->row_of_dirty = true;
+
+        free(tmp);
+        free(merged);
+        free(keys);
+        TRACE_END("sort", start);
+}
+
+/* ---------- Trigram search index ---------- */
+
+/* Inverted index from every (lowercase) 3 byte sequence of a task name
+ * or description to the sorted ids of the tasks containing it. A query
+ * intersects the lists of its own trigrams and then checks the few
+ * candidates left. Ids only grow, so adding a task appends to the lists. */
+
+typedef struct {
+        uint32_t *ids;
+        int size;
+        int capacity;
+} Posting;
+
+typedef struct search_index {
+        uint32_t *keys; /* trigram, 0 is an empty slot */
+        Posting *lists;
+        int size;
+        int capacity; /* power of two */
+} Search_index;
+
+typedef DA(uint32_t) Trigram_da;
+
+static inline uint32_t
+trigram(const char *c)
+{
+        return (uint32_t) (unsigned char) tolower((unsigned char) c[0]) << 16 |
+               (uint32_t) (unsigned char) tolower((unsigned char) c[1]) << 8 |
+               (uint32_t) (unsigned char) tolower((unsigned char) c[2]);
+}
+
+static void
+trigrams_of(const char *str, Trigram_da *out)
+{
+        if (!str)
+                return;
+        for (size_t i = 0, len = strlen(str); i + 3 <= len; i++)
+                da_append(out, trigram(str + i));
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+        uint32_t ea = *(uint32_t *) a;
+        uint32_t eb = *(uint32_t *) b;
+        return (ea > eb) - (ea < eb);
+}
+
+/* Unique trigrams of a task, sorted */
+static void
+task_trigrams(Task task, Trigram_da *out)
+{
+        int n = 0;
+
+        out->size = 0;
+        trigrams_of(task.name, out);
+        trigrams_of(task.desc, out);
+        qsort(out->data, out->size, sizeof *out->data, compare_u32);
+        for (int i = 0; i < out->size; i++)
+                if (i == 0 || out->data[i] != out->data[n - 1])
+                        out->data[n++] = out->data[i];
+        out->size = n;
+}
+
+static inline uint32_t
+search_hash(uint32_t key, int capacity)
+{
+        return (key * 2654435761u) & (capacity - 1);
+}
+
+static Posting *
+search_lookup(Search_index *idx, uint32_t key, bool create)
+{
+        uint32_t i;
+
+        if (create && (idx->size + 1) * 2 > idx->capacity) {
+                Search_index grown = { .capacity = idx->capacity ? idx->capacity * 2 : 1024 };
+                grown.keys = calloc(grown.capacity, sizeof *grown.keys);
+                grown.lists = calloc(grown.capacity, sizeof *grown.lists);
+                assert(grown.keys && grown.lists);
+                for (int j = 0; j < idx->capacity; j++) {
+                        if (!idx->keys[j])
+                                continue;
+                        for (i = search_hash(idx->keys[j], grown.capacity); grown.keys[i];)
+                                i = (i + 1) & (grown.capacity - 1);
+                        grown.keys[i] = idx->keys[j];
+                        grown.lists[i] = idx->lists[j];
+                }
+                grown.size = idx->size;
+                free(idx->keys);
+                free(idx->lists);
+                *idx = grown;
+        }
+
+        if (idx->capacity == 0)
+                return NULL;
+
+        for (i = search_hash(key, idx->capacity); idx->keys[i]; i = (i + 1) & (idx->capacity - 1))
+                if (idx->keys[i] == key)
+                        return &idx->lists[i];
+
+        if (!create)
+                return NULL;
+        idx->keys[i] = key;
+        ++idx->size;
+        return &idx->lists[i];
+}
+
+static void
+posting_append(Posting *p, uint32_t id)
+{
+        if (p->size == p->capacity) {
+                p->capacity = p->capacity ? p->capacity * 2 : 4;
+                p->ids = realloc(p->ids, p->capacity * sizeof *p->ids);
+                assert(p->ids);
+        }
+        p->ids[p->size++] = id;
+}
+
+/* Index of the first element >= ID */
+static int
+posting_lower_bound(const Posting *p, uint32_t id)
+{
+        int lo = 0;
+        int hi = p->size;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (p->ids[mid] < id)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+static void
+search_add(Search_index *idx, uint32_t id, Task task)
+{
+        static _Thread_local Trigram_da tg;
+        Posting *p;
+        int i;
+
+        task_trigrams(task, &tg);
+        for_da_each(t, tg)
+        {
+                p = search_lookup(idx, *t, true);
+                if (p->size == 0 || p->ids[p->size - 1] < id) {
+                        posting_append(p, id);
+                        continue;
+                }
+                i = posting_lower_bound(p, id);
+                posting_append(p, id);
+                memmove(p->ids + i + 1, p->ids + i, (p->size - i - 1) * sizeof *p->ids);
+                p->ids[i] = id;
+        }
+}
+
+static void
+search_remove(Search_index *idx, uint32_t id, Task task)
+{
+        static _Thread_local Trigram_da tg;
+        Posting *p;
+        int i;
+
+        task_trigrams(task, &tg);
+        for_da_each(t, tg)
+        {
+                if ((p = search_lookup(idx, *t, false)) == NULL)
+                        continue;
+                i = posting_lower_bound(p, id);
+                if (i < p->size && p->ids[i] == id) {
+                        memmove(p->ids + i, p->ids + i + 1, (p->size - i - 1) * sizeof *p->ids);
+                        --p->size;
+                }
+        }
+}
+
+static void
+search_destroy(Search_index *idx)
+{
+        for (int i = 0; i < idx->capacity; i++)
+                free(idx->lists[i].ids);
+        free(idx->keys);
+        free(idx->lists);
+        free(idx);
+}
+
+/* Build the index of S and keep it updated from now on */
+static void
+search_attach(Task_store *s)
+{
+        uint64_t start = monotonic_us();
+
+        if (s->search)
+                return;
+        s->search = calloc(1, sizeof *s->search);
+        assert(s->search);
+
+        /* In id order, so every posting list is built by appending */
+        for (uint32_t id = 0; id < s->next_id; id++) {
+                int row = store_row_of(s, id);
+                if (row >= 0)
+                        search_add(s->search, id, store_get(s, row));
+        }
+        TRACE_END("search_attach", start);
+}
+
+/* Case insensitive strstr */
+static bool
+contains_nocase(const char *haystack, const char *needle)
+{
+        size_t n = strlen(needle);
+
+        if (!haystack)
+                return false;
+        for (; *haystack; haystack++)
+                if (tolower((unsigned char) *haystack) == tolower((unsigned char) *needle) &&
+                    strncasecmp(haystack, needle, n) == 0)
+                        return true;
+        return n == 0;
+}
+
+/* Rows of S whose name or description contains QUERY (ignoring case) */
+static Task_view
+search_query(Task_store *s, const char *query)
+{
+        uint64_t start = monotonic_us();
+        Task_view v = { .rows = malloc((s->size + 1) * sizeof(int)) };
+        Trigram_da tg = { 0 };
+        Posting *shortest = NULL;
+        Posting *p;
+        int row;
+
+        assert(v.rows);
+
+        /* Too short to use the index */
+        if (strlen(query) < 3 || !s->search) {
+                for (int i = 0; i < s->size; i++)
+                        if (contains_nocase(s->name[i], query) || contains_nocase(s->desc[i], query))
+                                v.rows[v.size++] = i;
+                TRACE_END("search", start);
+                return v;
+        }
+
+        trigrams_of(query, &tg);
+        for_da_each(t, tg)
+        {
+                if ((p = search_lookup(s->search, *t, false)) == NULL || p->size == 0) {
+                        shortest = NULL;
+                        goto done;
+                }
+                if (!shortest || p->size < shortest->size)
+                        shortest = p;
+        }
+
+        /* Candidates are the ids of the shortest list found in every
+         * other list, then the text is checked as trigrams can come
+         * from both fields or be in the wrong order */
+        for (int i = 0; i < shortest->size; i++) {
+                uint32_t id = shortest->ids[i];
+                bool found = true;
+                for_da_each(t, tg)
+                {
+                        p = search_lookup(s->search, *t, false);
+                        int j = posting_lower_bound(p, id);
+                        if (j == p->size || p->ids[j] != id) {
+                                found = false;
+                                break;
+                        }
+                }
+                if (!found || (row = store_row_of(s, id)) < 0)
+                        continue;
+                if (contains_nocase(s->name[row], query) || contains_nocase(s->desc[row], query))
+                        v.rows[v.size++] = row;
+        }
+
+        /* Back to row (due date) order */
+        qsort(v.rows, v.size, sizeof *v.rows, compare_u32);
+done:
+        da_destroy(&tg);
+        TRACE_END("search", start);
+        return v;
+}
+
+static Task_view
+view_all(Task_store *s)
+{
+        Task_view v = { .rows = malloc((s->size + 1) * sizeof(int)), .size = s->size };
+        assert(v.rows);
+        for (int i = 0; i < s->size; i++)
+                v.rows[i] = i;
+        return v;
+}
+
+static void
+view_destroy(Task_view *v)
+{
+        free(v->rows);
+        free(v->due);
+        ZERO(v);
+}
+
+/* Due date of entry I of V */
+static inline time_t
+view_due(Task_store *s, Task_view v, int i)
+{
+        return v.due ? v.due[i] : s->due[v.rows[i]];
+}
+
+/* ---------- Tags and projects ---------- */
+
+/* Tag and project names are interned, a task only keeps their ids.
+ * Ids start at 1 so 0 can be "none" and end a tag list. */
+
+typedef struct {
+        char **names;    /* by id, names[0] is unused */
+        uint32_t *slots; /* open addressing over ids, 0 is an empty slot */
+        uint32_t size;   /* next id */
+        uint32_t capacity;
+        uint32_t nslots; /* power of two */
+} Symbol_table;
+
+static Symbol_table symbols;
+
+static inline uint32_t
+symbol_hash(const char *name)
+{
+        uint32_t h = 2166136261u;
+        for (; *name; name++)
+                h = (h ^ (unsigned char) *name) * 16777619u;
+        return h;
+}
+
+static uint32_t *
+symbol_slot(const char *name)
+{
+        uint32_t i = symbol_hash(name) & (symbols.nslots - 1);
+        while (symbols.slots[i] && strcmp(symbols.names[symbols.slots[i]], name))
+                i = (i + 1) & (symbols.nslots - 1);
+        return &symbols.slots[i];
+}
+
+/* Id of NAME. It is added if CREATE, otherwise 0 is returned for
+ * unknown names. */
+static uint32_t
+intern(const char *name, bool create)
+{
+        uint32_t *slot;
+
+        if (symbols.nslots == 0) {
+                if (!create)
+                        return 0;
+                symbols.size = 1;
+                symbols.nslots = 64;
+                symbols.slots = calloc(symbols.nslots, sizeof *symbols.slots);
+                assert(symbols.slots);
+        }
+
+        slot = symbol_slot(name);
+        if (*slot || !create)
+                return *slot;
+
+        if (symbols.size >= symbols.capacity) {
+                symbols.capacity = symbols.capacity ? symbols.capacity * 2 : 32;
+                symbols.names = realloc(symbols.names, symbols.capacity * sizeof *symbols.names);
+                assert(symbols.names);
+        }
+        symbols.names[symbols.size] = strdup(name);
+        *slot = symbols.size++;
+
+        if (symbols.size * 2 > symbols.nslots) {
+                free(symbols.slots);
+                symbols.nslots *= 2;
+                symbols.slots = calloc(symbols.nslots, sizeof *symbols.slots);
+                assert(symbols.slots);
+                for (uint32_t id = 1; id < symbols.size; id++)
+                        *symbol_slot(symbols.names[id]) = id;
+        }
+        return symbols.size - 1;
+}
+
+static inline const char *
+symbol_name(uint32_t id)
+{
+        return id && id < symbols.size ? symbols.names[id] : "";
+}
+
+static void
+symbols_destroy()
+{
+        for (uint32_t id = 1; id < symbols.size; id++)
+                free(symbols.names[id]);
+        free(symbols.names);
+        free(symbols.slots);
+        ZERO(&symbols);
+}
+
+/* Parse a comma separated list of names into a sorted, 0 terminated
+ * array of ids. Returns NULL if there are no names. Unknown names are
+ * added if CREATE, otherwise they are stored as UINT32_MAX so nothing
+ * matches them. */
+static uint32_t *
+parse_tags(const char *str, bool create)
+{
+        uint32_t *tags = NULL;
+        int n = 0;
+        char name[64];
+
+        while (*str) {
+                size_t len;
+                uint32_t id;
+
+                str += strspn(str, " ,");
+                len = strcspn(str, ",\n");
+                while (len > 0 && str[len - 1] == ' ')
+                        --len;
+                if (len == 0)
+                        break;
+                snprintf(name, sizeof name, "%.*s", (int) len, str);
+                str += len;
+                str += strcspn(str, ",");
+
+                if ((id = intern(name, create)) == 0)
+                        id = UINT32_MAX;
+                tags = realloc(tags, (n + 2) * sizeof *tags);
+                assert(tags);
+                tags[n++] = id;
+        }
+        if (!tags)
+                return NULL;
+
+        qsort(tags, n, sizeof *tags, compare_u32);
+        int unique = 0;
+        for (int i = 0; i < n; i++)
+                if (i == 0 || tags[i] != tags[unique - 1])
+                        tags[unique++] = tags[i];
+        tags[unique] = 0;
+        return tags;
+}
+
+static void
+ob_tags(Outbuf *ob, const uint32_t *tags)
+{
+        for (const uint32_t *t = tags; t && *t; t++)
+                ob_printf(ob, t == tags ? "%s" : ", %s", symbol_name(*t));
+}
+
+static inline bool
+has_tag(const uint32_t *tags, uint32_t id)
+{
+        for (const uint32_t *t = tags; t && *t; t++)
+                if (*t == id)
+                        return true;
+        return false;
+}
+
+/* Roaring style bitmap of task ids. Ids are split by their high 16
+ * bits into containers, a sparse container is a sorted array of the
+ * low 16 bits and a dense one (more than ROARING_ARRAY_MAX ids) is a
+ * plain 65536 bit set. */
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_WORDS (65536 / 64)
+
+typedef struct {
+        uint16_t key;
+        int size;       /* cardinality */
+        int capacity;   /* of array */
+        uint16_t *array;
+        uint64_t *bits; /* used instead of array if not NULL */
+} Container;
+
+typedef struct {
+        Container *c;
+        int size;
+        int capacity;
+} Roaring;
+
+/* Index of the first container whose key is >= KEY */
+static int
+roaring_lower_bound(const Roaring *r, uint16_t key)
+{
+        int lo = 0;
+        int hi = r->size;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (r->c[mid].key < key)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+static int
+u16_lower_bound(const uint16_t *a, int n, uint16_t x)
+{
+        int lo = 0;
+        int hi = n;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (a[mid] < x)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+static inline bool
+container_contains(const Container *c, uint16_t low)
+{
+        int i;
+        if (c->bits)
+                return c->bits[low / 64] >> (low % 64) & 1;
+        i = u16_lower_bound(c->array, c->size, low);
+        return i < c->size && c->array[i] == low;
+}
+
+static bool
+roaring_contains(const Roaring *r, uint32_t id)
+{
+        int i = roaring_lower_bound(r, id >> 16);
+        return i < r->size && r->c[i].key == id >> 16 && container_contains(&r->c[i], id & 0xffff);
+}
+
+static void
+container_to_bits(Container *c)
+{
+        c->bits = calloc(ROARING_WORDS, sizeof *c->bits);
+        assert(c->bits);
+        for (int i = 0; i < c->size; i++)
+                c->bits[c->array[i] / 64] |= 1ull << (c->array[i] % 64);
+        free(c->array);
+        c->array = NULL;
+        c->capacity = 0;
+}
+
+static void
+container_to_array(Container *c)
+{
+        int n = 0;
+        c->array = malloc(c->size * sizeof *c->array);
+        assert(c->array);
+        c->capacity = c->size;
+        for (int w = 0; w < ROARING_WORDS; w++)
+                for (uint64_t b = c->bits[w]; b; b &= b - 1)
+                        c->array[n++] = w * 64 + __builtin_ctzll(b);
+        free(c->bits);
+        c->bits = NULL;
+}
+
+static void
+roaring_add(Roaring *r, uint32_t id)
+{
+        uint16_t low = id & 0xffff;
+        int i = roaring_lower_bound(r, id >> 16);
+        Container *c;
+
+        if (i == r->size || r->c[i].key != id >> 16) {
+                if (r->size == r->capacity) {
+                        r->capacity = r->capacity ? r->capacity * 2 : 4;
+                        r->c = realloc(r->c, r->capacity * sizeof *r->c);
+                        assert(r->c);
+                }
+                memmove(r->c + i + 1, r->c + i, (r->size - i) * sizeof *r->c);
+                r->c[i] = (Container) { .key = id >> 16 };
+                ++r->size;
+        }
+
+        c = &r->c[i];
+        if (container_contains(c, low))
+                return;
+        if (c->bits) {
+                c->bits[low / 64] |= 1ull << (low % 64);
+                ++c->size;
+                return;
+        }
+        if (c->size == ROARING_ARRAY_MAX) {
+                container_to_bits(c);
+                c->bits[low / 64] |= 1ull << (low % 64);
+                ++c->size;
+                return;
+        }
+        if (c->size == c->capacity) {
+                c->capacity = c->capacity ? c->capacity * 2 : 4;
+                c->array = realloc(c->array, c->capacity * sizeof *c->array);
+                assert(c->array);
+        }
+        /* Ids are mostly added in increasing order */
+        int j = c->size > 0 && c->array[c->size - 1] < low ? c->size : u16_lower_bound(c->array, c->size, low);
+        memmove(c->array + j + 1, c->array + j, (c->size - j) * sizeof *c->array);
+        c->array[j] = low;
+        ++c->size;
+}
+
+static void
+roaring_remove(Roaring *r, uint32_t id)
+{
+        uint16_t low = id & 0xffff;
+        int i = roaring_lower_bound(r, id >> 16);
+        Container *c;
+
+        if (i == r->size || r->c[i].key != id >> 16 || !container_contains(&r->c[i], low))
+                return;
+
+        c = &r->c[i];
+        if (c->bits) {
+                c->bits[low / 64] &= ~(1ull << (low % 64));
+                /* Half the threshold, so add/remove at the edge does
+                 * not convert every time */
+                if (--c->size <= ROARING_ARRAY_MAX / 2)
+                        container_to_array(c);
+        } else {
+                int j = u16_lower_bound(c->array, c->size, low);
+                memmove(c->array + j, c->array + j + 1, (c->size - j - 1) * sizeof *c->array);
+                --c->size;
+        }
+
+        if (c->size == 0) {
+                free(c->array);
+                free(c->bits);
+                memmove(r->c + i, r->c + i + 1, (r->size - i - 1) * sizeof *r->c);
+                --r->size;
+        }
+}
+
+static int
+roaring_cardinality(const Roaring *r)
+{
+        int n = 0;
+        for (int i = 0; i < r->size; i++)
+                n += r->c[i].size;
+        return n;
+}
+
+/* OUT = A & B. OUT must be empty and can not be A or B. */
+static void
+roaring_and(const Roaring *a, const Roaring *b, Roaring *out)
+{
+        int i = 0;
+        int j = 0;
+
+        while (i < a->size && j < b->size) {
+                const Container *ca = &a->c[i];
+                const Container *cb = &b->c[j];
+                Container c = { .key = ca->key };
+
+                if (ca->key != cb->key) {
+                        if (ca->key < cb->key)
+                                ++i;
+                        else
+                                ++j;
+                        continue;
+                }
+                ++i;
+                ++j;
+
+                if (ca->bits && cb->bits) {
+                        c.bits = malloc(ROARING_WORDS * sizeof *c.bits);
+                        assert(c.bits);
+                        for (int w = 0; w < ROARING_WORDS; w++) {
+                                c.bits[w] = ca->bits[w] & cb->bits[w];
+                                c.size += __builtin_popcountll(c.bits[w]);
+                        }
+                        if (c.size <= ROARING_ARRAY_MAX)
+                                container_to_array(&c);
+                } else {
+                        /* At least one array, so the result fits in one */
+                        if (ca->bits) {
+                                const Container *t = ca;
+                                ca = cb;
+                                cb = t;
+                        }
+                        c.array = malloc((ca->size + 1) * sizeof *c.array);
+                        assert(c.array);
+                        c.capacity = ca->size;
+                        for (int k = 0; k < ca->size; k++)
+                                if (container_contains(cb, ca->array[k]))
+                                        c.array[c.size++] = ca->array[k];
+                }
+
+                if (c.size == 0) {
+                        free(c.array);
+                        free(c.bits);
+                        continue;
+                }
+                if (out->size == out->capacity) {
+                        out->capacity = out->capacity ? out->capacity * 2 : 4;
+                        out->c = realloc(out->c, out->capacity * sizeof *out->c);
+                        assert(out->c);
+                }
+                out->c[out->size++] = c;
+        }
+}
+
+/* Write the ids of R to OUT in increasing order, returns how many */
+static int
+roaring_ids(const Roaring *r, uint32_t *out)
+{
+        int n = 0;
+        for (int i = 0; i < r->size; i++) {
+                const Container *c = &r->c[i];
+                uint32_t high = (uint32_t) c->key << 16;
+                if (c->bits) {
+                        for (int w = 0; w < ROARING_WORDS; w++)
+                                for (uint64_t b = c->bits[w]; b; b &= b - 1)
+                                        out[n++] = high | (w * 64 + __builtin_ctzll(b));
+                } else {
+                        for (int k = 0; k < c->size; k++)
+                                out[n++] = high | c->array[k];
+                }
+        }
+        return n;
+}
+
+static void
+roaring_destroy(Roaring *r)
+{
+        for (int i = 0; i < r->size; i++) {
+                free(r->c[i].array);
+                free(r->c[i].bits);
+        }
+        free(r->c);
+        ZERO(r);
+}
+
+/* One bitmap of task ids per tag and per project, indexed by symbol
+ * id. Like the search index it is only built when a view needs it. */
+typedef struct tag_index {
+        Roaring *by_tag;
+        Roaring *by_project;
+        uint32_t capacity;
+} Tag_index;
+
+static void
+tag_index_reserve(Tag_index *idx, uint32_t sym)
+{
+        uint32_t n = idx->capacity;
+
+        if (sym < n)
+                return;
+        while (sym >= n)
+                n = n ? n * 2 : 32;
+        idx->by_tag = realloc(idx->by_tag, n * sizeof *idx->by_tag);
+        idx->by_project = realloc(idx->by_project, n * sizeof *idx->by_project);
+        assert(idx->by_tag && idx->by_project);
+        memset(idx->by_tag + idx->capacity, 0, (n - idx->capacity) * sizeof *idx->by_tag);
+        memset(idx->by_project + idx->capacity, 0, (n - idx->capacity) * sizeof *idx->by_project);
+        idx->capacity = n;
+}
+
+static void
+tag_index_add(Tag_index *idx, uint32_t id, Task task)
+{
+        if (task.project) {
+                tag_index_reserve(idx, task.project);
+                roaring_add(&idx->by_project[task.project], id);
+        }
+        for (uint32_t *t = task.tags; t && *t; t++) {
+                tag_index_reserve(idx, *t);
+                roaring_add(&idx->by_tag[*t], id);
+        }
+}
+
+static void
+tag_index_remove(Tag_index *idx, uint32_t id, Task task)
+{
+        if (task.project && task.project < idx->capacity)
+                roaring_remove(&idx->by_project[task.project], id);
+        for (uint32_t *t = task.tags; t && *t; t++)
+                if (*t < idx->capacity)
+                        roaring_remove(&idx->by_tag[*t], id);
+}
+
+static void
+tag_index_destroy(Tag_index *idx)
+{
+        for (uint32_t i = 0; i < idx->capacity; i++) {
+                roaring_destroy(&idx->by_tag[i]);
+                roaring_destroy(&idx->by_project[i]);
+        }
+        free(idx->by_tag);
+        free(idx->by_project);
+        free(idx);
+}
+
+/* Build the tag index of S and keep it updated from now on */
+static void
+tag_index_attach(Task_store *s)
+{
+        uint64_t start = monotonic_us();
+
+        if (s->tag_index)
+                return;
+        s->tag_index = calloc(1, sizeof *s->tag_index);
+        assert(s->tag_index);
+
+        /* In id order, so containers are filled by appending */
+        for (uint32_t id = 0; id < s->next_id; id++) {
+                int row = store_row_of(s, id);
+                if (row >= 0)
+                        tag_index_add(s->tag_index, id, store_get(s, row));
+        }
+        TRACE_END("tag_index_attach", start);
+}
+
+/* Bitmap of the tag or project SYM, NULL if no task has it */
+static const Roaring *
+tag_index_get(Tag_index *idx, uint32_t sym, bool project)
+{
+        if (sym == 0 || sym >= idx->capacity)
+                return NULL;
+        return project ? &idx->by_project[sym] : &idx->by_tag[sym];
+}
+
+/* Keep the entries of V whose task has every tag of TAGS (sorted, 0
+ * terminated, may be NULL) and is in PROJECT (0 for any). The bitmaps
+ * are intersected first; then, if the result is smaller than V, its
+ * ids are turned into rows and looked up in V, otherwise every entry
+ * of V is checked against it. */
+static void
+view_filter_tags(Task_store *s, Task_view *v, const uint32_t *tags, uint32_t project)
+{
+        uint64_t start = monotonic_us();
+        const Roaring **sets;
+        int nsets = 0;
+        Roaring acc = { 0 };
+        const Roaring *set;
+        int n = 0;
+
+        if (!project && (!tags || !*tags))
+                return;
+        tag_index_attach(s);
+
+        for (const uint32_t *t = tags; t && *t; t++)
+                ++nsets;
+        sets = calloc(nsets + 1, sizeof *sets);
+        assert(sets);
+        nsets = 0;
+        if (project)
+                sets[nsets++] = tag_index_get(s->tag_index, project, true);
+        for (const uint32_t *t = tags; t && *t; t++)
+                sets[nsets++] = tag_index_get(s->tag_index, *t, false);
+
+        /* Smallest first, so every intersection is cheap */
+        for (int i = 0; i < nsets; i++) {
+                if (!sets[i] || sets[i]->size == 0) {
+                        v->size = 0;
+                        goto done;
+                }
+                for (int j = i; j > 0 && roaring_cardinality(sets[j]) < roaring_cardinality(sets[j - 1]); j--) {
+                        set = sets[j];
+                        sets[j] = sets[j - 1];
+                        sets[j - 1] = set;
+                }
+        }
+        set = sets[0];
+        for (int i = 1; i < nsets; i++) {
+                Roaring next = { 0 };
+                roaring_and(set, sets[i], &next);
+                roaring_destroy(&acc);
+                acc = next;
+                set = &acc;
+        }
+
+        /* Expanded views can repeat rows, they are always checked */
+        if (v->due || roaring_cardinality(set) >= v->size) {
+                for (int i = 0; i < v->size; i++) {
+                        if (!roaring_contains(set, s->id[v->rows[i]]))
+                                continue;
+                        if (v->due)
+                                v->due[n] = v->due[i];
+                        v->rows[n++] = v->rows[i];
+                }
+                v->size = n;
+        } else {
+                int *rows = malloc((roaring_cardinality(set) + 1) * sizeof *rows);
+                int m = 0;
+                int count;
+                assert(rows);
+                /* Ids and rows have the same size, convert in place */
+                count = roaring_ids(set, (uint32_t *) rows);
+                for (int i = 0; i < count; i++)
+                        if ((rows[m] = store_row_of(s, ((uint32_t *) rows)[i])) >= 0)
+                                ++m;
+                qsort(rows, m, sizeof *rows, compare_u32);
+                /* V is sorted by row, every match is at or after the
+                 * previous one so it can be written in place */
+                for (int j = 0, i = 0; j < m; j++) {
+                        int lo = i;
+                        int hi = v->size;
+                        while (lo < hi) {
+                                int mid = lo + (hi - lo) / 2;
+                                if (v->rows[mid] < rows[j])
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        if ((i = lo) == v->size)
+                                break;
+                        if (v->rows[i] == rows[j])
+                                v->rows[n++] = v->rows[i++];
+                }
+                v->size = n;
+                free(rows);
+        }
+
+done:
+        roaring_destroy(&acc);
+        free(sets);
+        TRACE_END("view_filter_tags", start);
+}
+
+/* Number of tasks with tag or project SYM */
+static int
+tag_count(Task_store *s, uint32_t sym, bool project)
+{
+        const Roaring *set;
+        tag_index_attach(s);
+        set = tag_index_get(s->tag_index, sym, project);
+        return set ? roaring_cardinality(set) : 0;
+}
+
+/* ---------- Repeating tasks ---------- */
+
+#define EVERY_MAX 100000 /* days, weeks or months */
+
+/* Whether the N chars at STR are one of the words of the NULL ended
+ * list */
+static bool
+word_in(const char *str, size_t n, ...)
+{
+        va_list ap;
+        const char *word;
+        bool found = false;
+
+        va_start(ap, n);
+        while (!found && (word = va_arg(ap, const char *)))
+                found = strlen(word) == n && strncmp(str, word, n) == 0;
+        va_end(ap);
+        return found;
+}
+
+/* "daily", "weekly", "monthly", "N" / "N days" / "Nd", "N weeks" or
+ * "N months". Anything else is rejected. */
+static bool
+parse_every(const char *str, int *every)
+{
+        const char *unit;
+        char *end;
+        size_t len;
+        long n;
+
+        while (isspace((unsigned char) *str))
+                ++str;
+        len = strlen(str);
+        while (len > 0 && isspace((unsigned char) str[len - 1]))
+                --len;
+
+        if (word_in(str, len, "daily", NULL))
+                *every = 1;
+        else if (word_in(str, len, "weekly", NULL))
+                *every = 7;
+        else if (word_in(str, len, "monthly", NULL))
+                *every = -1;
+        else if (isdigit((unsigned char) *str) && (n = strtol(str, &end, 10)) > 0 && n <= EVERY_MAX) {
+                unit = end;
+                while (isspace((unsigned char) *unit))
+                        ++unit;
+                len -= unit - str;
+                if (len == 0 || word_in(unit, len, "d", "day", "days", NULL))
+                        *every = n;
+                else if (word_in(unit, len, "w", "week", "weeks", NULL))
+                        *every = 7 * n;
+                else if (word_in(unit, len, "m", "month", "months", NULL))
+                        *every = -n;
+                else
+                        return false;
+        } else
+                return false;
+        return true;
+}
+
+static const char *
+format_every(int every)
+{
+        static char buf[32];
+        switch (every) {
+        case 1:
+                return "daily";
+        case 7:
+                return "weekly";
+        case -1:
+                return "monthly";
+        }
+        snprintf(buf, sizeof buf, every > 0 ? "%d days" : "%d months", every > 0 ? every : -every);
+        return buf;
+}
+
+/* K-th occurrence after DUE of a task repeating EVERY, or -1 if it
+ * cannot be represented */
+static time_t
+nth_occurrence(time_t due, int every, int k)
+{
+        struct tm tp;
+        int mday;
+
+        if (!localtime_r(&due, &tp) || k > INT_MAX / 2 / abs(every))
+                return -1;
+        mday = tp.tm_mday;
+        if (every > 0)
+                tp.tm_mday += every * k;
+        else
+                tp.tm_mon -= every * k;
+        tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
+
+        /* The 31st of a month repeats on the last day of shorter months */
+        if (every < 0) {
+                struct tm check = tp;
+                mktime(&check);
+                if (check.tm_mday != mday) {
+                        tp.tm_mday = 0;
+                        ++tp.tm_mon;
+                }
+        }
+        return mktime(&tp);
+}
+
+static time_t
+next_occurrence(time_t due, int every)
+{
+        return nth_occurrence(due, every, 1);
+}
+
+/* Least K >= 1 whose occurrence may fall on or after LO, or -1 if
+ * there is none. It is at most one period early (summer time, shorter
+ * months), the caller steps to LO. */
+static int
+first_occurrence(time_t due, int every, time_t lo)
+{
+        struct tm tp, tlo;
+        long long k;
+
+        if (lo <= due)
+                return 1;
+        if (every > 0)
+                k = (lo - due) / (every * 86400LL) - 1;
+        else if (localtime_r(&due, &tp) && localtime_r(&lo, &tlo))
+                k = ((tlo.tm_year - tp.tm_year) * 12LL + tlo.tm_mon - tp.tm_mon) / -every - 1;
+        else
+                return -1;
+        if (k > INT_MAX / 2 / abs(every))
+                return -1;
+        return k < 1 ? 1 : k;
+}
+
+/* Add to V the occurrences of its repeating rows that follow the stored
+ * one, in [LO, HI] and at most REPEAT_MAX per row. They are only
+ * generated for the window being asked for and are never stored. */
+static Task_view
+view_expand(Task_store *s, Task_view v, time_t lo, time_t hi)
+{
+        DA(struct sort_key) entries = { 0 };
+        Task_view out = { 0 };
+        bool repeats = false;
+        time_t t;
+
+        if (hi == TIME_MAX)
+                return v;
+        for (int i = 0; i < v.size && !repeats; i++)
+                repeats = s->every[v.rows[i]] != 0;
+        if (!repeats)
+                return v;
+
+        for (int i = 0; i < v.size; i++) {
+                int row = v.rows[i];
+                t = view_due(s, v, i);
+                da_append(&entries, ((struct sort_key) { .due = t, .row = row }));
+                if (s->every[row] == 0 || (v.due && t != s->due[row]))
+                        continue;
+                /* Counted from the stored date so months do not drift */
+                int k = first_occurrence(s->due[row], s->every[row], lo);
+                for (int n = 0; k > 0 && n < REPEAT_MAX; k++) {
+                        t = nth_occurrence(s->due[row], s->every[row], k);
+                        if (t == -1 || t > hi)
+                                break;
+                        if (t < lo)
+                                continue;
+                        da_append(&entries, ((struct sort_key) { .due = t, .row = row }));
+                        n++;
+                }
+        }
+        qsort(entries.data, entries.size, sizeof *entries.data, compare_sort_keys);
+
+        out.size = entries.size;
+        out.rows = malloc((out.size + 1) * sizeof *out.rows);
+        out.due = malloc((out.size + 1) * sizeof *out.due);
+        assert(out.rows && out.due);
+        for (int i = 0; i < out.size; i++) {
+                out.rows[i] = entries.data[i].row;
+                out.due[i] = entries.data[i].due;
+        }
+
+        da_destroy(&entries);
+        view_destroy(&v);
+        return out;
+}
+
+static void archive_add(Task task, time_t done);
+static void undo_record(Undo_kind kind, Undo_op op, Task task);
+
+/* Mark ROW as done: remove it, or move a repeating task to its next
+ * occurrence. */
+static void
+task_done(Task_store *s, int row)
+{
+        Task task;
+
+        if (row < 0 || row >= s->size)
+                return;
+        archive_add(store_get(s, row), time(NULL));
+        undo_record(UNDO_DONE, UNDO_REMOVE, store_get(s, row));
+        if (s->every[row] == 0) {
+                store_remove(s, row);
+                return;
+        }
+        task = store_take(s, row);
+        task.due = next_occurrence(task.due, task.every);
+        undo_record(UNDO_DONE, UNDO_INSERT, task);
+        store_insert(s, task);
+}
+
+/* ---------- Due date window kernels ---------- */
+
+/* Count and select the rows with LO <= due <= HI. The store does not
+ * need to be sorted. There are AVX2 and SSE4.2 versions, picked at
+ * runtime, and a scalar fallback for other machines. */
+
+static int
+count_due_scalar(const time_t *due, int n, time_t lo, time_t hi)
+{
+        int count = 0;
+        for (int i = 0; i < n; i++)
+                count += (due[i] >= lo) & (due[i] <= hi);
+        return count;
+}
+
+static int
+select_due_scalar(const time_t *due, int n, time_t lo, time_t hi, int *rows)
+{
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+                rows[count] = i;
+                count += (due[i] >= lo) & (due[i] <= hi);
+        }
+        return count;
+}
+
+#if defined(__x86_64__)
+static_assert(sizeof(time_t) == sizeof(int64_t), "due kernels expect 64 bit time_t");
+
+__attribute__((target("avx2"))) static inline int
+due_mask_avx2(const time_t *due, __m256i lo, __m256i hi)
+{
+        __m256i v = _mm256_loadu_si256((const __m256i *) due);
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(lo, v), _mm256_cmpgt_epi64(v, hi));
+        return ~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xF;
+}
+
+__attribute__((target("avx2,popcnt"))) static int
+count_due_avx2(const time_t *due, int n, time_t lo, time_t hi)
+{
+        __m256i vlo = _mm256_set1_epi64x(lo);
+        __m256i vhi = _mm256_set1_epi64x(hi);
+        int count = 0;
+        int i;
+
+        for (i = 0; i + 4 <= n; i += 4)
+                count += __builtin_popcount(due_mask_avx2(due + i, vlo, vhi));
+        return count + count_due_scalar(due + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2"))) static int
+select_due_avx2(const time_t *due, int n, time_t lo, time_t hi, int *rows)
+{
+        __m256i vlo = _mm256_set1_epi64x(lo);
+        __m256i vhi = _mm256_set1_epi64x(hi);
+        int count = 0;
+        int mask;
+        int i;
+
+        for (i = 0; i + 4 <= n; i += 4) {
+                mask = due_mask_avx2(due + i, vlo, vhi);
+                while (mask) {
+                        rows[count++] = i + __builtin_ctz(mask);
+                        mask &= mask - 1;
+                }
+        }
+        for (; i < n; i++) {
+                rows[count] = i;
+                count += (due[i] >= lo) & (due[i] <= hi);
+        }
+        return count;
+}
+
+__attribute__((target("sse4.2"))) static inline int
+due_mask_sse42(const time_t *due, __m128i lo, __m128i hi)
+{
+        __m128i v = _mm_loadu_si128((const __m128i *) due);
+        __m128i out = _mm_or_si128(_mm_cmpgt_epi64(lo, v), _mm_cmpgt_epi64(v, hi));
+        return ~_mm_movemask_pd(_mm_castsi128_pd(out)) & 0x3;
+}
+
+__attribute__((target("sse4.2"))) static int
+count_due_sse42(const time_t *due, int n, time_t lo, time_t hi)
+{
+        __m128i vlo = _mm_set1_epi64x(lo);
+        __m128i vhi = _mm_set1_epi64x(hi);
+        int count = 0;
+        int i;
+
+        for (i = 0; i + 2 <= n; i += 2)
+                count += __builtin_popcount(due_mask_sse42(due + i, vlo, vhi));
+        return count + count_due_scalar(due + i, n - i, lo, hi);
+}
+
+__attribute__((target("sse4.2"))) static int
+select_due_sse42(const time_t *due, int n, time_t lo, time_t hi, int *rows)
+{
+        __m128i vlo = _mm_set1_epi64x(lo);
+        __m128i vhi = _mm_set1_epi64x(hi);
+        int count = 0;
+        int mask;
+        int i;
+
+        for (i = 0; i + 2 <= n; i += 2) {
+                mask = due_mask_sse42(due + i, vlo, vhi);
+                rows[count] = i + (mask == 2);
+                rows[count + 1] = i + 1;
+                count += __builtin_popcount(mask);
+        }
+        for (; i < n; i++) {
+                rows[count] = i;
+                count += (due[i] >= lo) & (due[i] <= hi);
+        }
+        return count;
+}
+#endif
+
+#define SELECT_SLACK 2
+
+static int (*count_due_kernel)(const time_t *, int, time_t, time_t);
+static int (*select_due_kernel)(const time_t *, int, time_t, time_t, int *);
+
+static void
+due_kernels_init()
+{
+        count_due_kernel = count_due_scalar;
+        select_due_kernel = select_due_scalar;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                count_due_kernel = count_due_avx2;
+                select_due_kernel = select_due_avx2;
+        } else if (__builtin_cpu_supports("sse4.2")) {
+                count_due_kernel = count_due_sse42;
+                select_due_kernel = select_due_sse42;
+        }
+#endif
+}
+
+static int
+count_due_between(Task_store *s, time_t lo, time_t hi)
+{
+        if (!count_due_kernel)
+                due_kernels_init();
+        return count_due_kernel(s->due, s->size, lo, hi);
+}
+
+static Task_view
+select_due_between(Task_store *s, time_t lo, time_t hi)
+{
+        Task_view v = { 0 };
+
+        if (!select_due_kernel)
+                due_kernels_init();
+
+        /* Counting is much cheaper than selecting. The kernels may write
+         * up to SELECT_SLACK rows past the last match. */
+        v.rows = malloc((count_due_between(s, lo, hi) + SELECT_SLACK) * sizeof(int));
+        assert(v.rows);
+        v.size = select_due_kernel(s->due, s->size, lo, hi, v.rows);
+        return v;
+}
+
+static void
+list_tasks(int fd, Task_view v, const char *format, ...)
+{
+        va_list arg;
+        va_start(arg, format);
+        uint64_t start = monotonic_us();
+        Outbuf ob = { .fd = fd };
+
+        if (!*quiet) {
+                ob_vprintf(&ob, format, arg);
+                ob_puts(&ob, ":\n");
+        }
+        for (int i = 0; i < v.size; i++) {
+                Task e = store_get(&data, v.rows[i]);
+                ob_printf(&ob, "%d: %s (%s)", v.rows[i], e.name, overload_date(view_due(&data, v, i)));
+                if (e.project)
+                        ob_printf(&ob, " @%s", symbol_name(e.project));
+                for (uint32_t *t = e.tags; t && *t; t++)
+                        ob_printf(&ob, " #%s", symbol_name(*t));
+                if (e.desc)
+                        ob_printf(&ob, ": %s\n", e.desc);
+                else
+                        ob_puts(&ob, "\n");
+        }
+        if (v.size == 0 && !*quiet)
+                ob_printf(&ob, "  %s\n", no_tasks_messages[rand() % 10]);
+        ob_flush(&ob);
+        ob_destroy(&ob);
+        va_end(arg);
+        TRACE_END("output", start);
+}
+
+/* The task file is read at once and split at "\n[" into up to
+ * LOAD_THREADS chunks of at least LOAD_CHUNK bytes, parsed (dates
+ * included) in parallel. Lines have no length limit. Tag and project
+ * names are kept as text and interned when the chunks are appended in
+ * file order, so symbol ids and rows are the same as with one thread. */
+typedef struct {
+        Task task;
+        const char *tags; /* in the file buffer */
+        const char *project;
+} Parsed_task;
+
+typedef DA(Parsed_task) Parsed_da;
+
+struct load_chunk {
+        char *start;
+        size_t size;
+        Parsed_da tasks;
+};
+
+static void
+parsed_add(Parsed_da *out, Parsed_task p)
+{
+        if (p.task.name && p.task.due) {
+                da_append(out, p);
+        } else
+                task_free(p.task);
+}
+
+static void *
+load_chunk(void *args)
+{
+        struct load_chunk *chunk = args;
+        char *line = chunk->start;
+        char *end = chunk->start + chunk->size;
+        char *next;
+        Parsed_task p = { 0 };
+        uint64_t start = monotonic_us();
+        uint64_t date_start;
+        uint64_t date_us = 0; /* time spent parsing dates */
+        char trace_args[64];
+
+        /* Lines are ended in place, the last one by the byte after
+         * the file, see load_from_file() */
+        for (; line < end; line = next) {
+                if ((next = memchr(line, '\n', end - line)))
+                        *next++ = 0;
+                else
+                        next = end;
+
+                switch (line[0]) {
+                        /* NAME */
+                case '[':
+                        parsed_add(&chunk->tasks, p);
+                        ZERO(&p);
+                        TRUNCAT(line, ']');
+                        p.task.name = strdup(line + 1);
+                        break;
+
+                        /* DESCRIPTION */
+                case ' ':
+                        if (!strncmp(line + 2, "desc: ", 6)) {
+                                free(p.task.desc);
+                                p.task.desc = strdup(line + 8);
+                        }
+
+                        /* DATE TIME */
+                        else if (!strncmp(line + 2, "date: ", 6)) {
+                                date_start = trace_fd >= 0 ? monotonic_us() : 0;
+                                p.task.due = parse_due(line + 8);
+                                if (trace_fd >= 0)
+                                        date_us += monotonic_us() - date_start;
+                        }
+
+                        /* REPEAT */
+                        else if (!strncmp(line + 2, "every: ", 7)) {
+                                if (!parse_every(line + 9, &p.task.every))
+                                        LOG("Can not load %s\n", line + 9);
+                        }
+
+                        /* TAGS */
+                        else if (!strncmp(line + 2, "tags: ", 6))
+                                p.tags = line + 8;
+
+                        /* PROJECT */
+                        else if (!strncmp(line + 2, "project: ", 9))
+                                p.project = line[11] ? line + 11 : NULL;
+
+                        /* INVALID ARGUMENT */
+                        else
+                                LOG("Unknown token: %s\n", line);
+                        break;
+
+                case 0:
+                        break;
+                default:
+                        LOG("Unknown token: %s\n", line);
+                        break;
+                }
+        }
+
+        parsed_add(&chunk->tasks, p);
+
+        /* Date parsing is interleaved with tokenizing, so it is shown
+         * as one aggregated span followed by the rest */
+        if (trace_fd >= 0) {
+                uint64_t total = monotonic_us() - start;
+                snprintf(trace_args, sizeof trace_args, "{\"tasks\":%d}", chunk->tasks.size);
+                trace_event("load_from_file/chunk", start, total, trace_args);
+                trace_event("load_from_file/dates", start, date_us, NULL);
+                trace_event("load_from_file/parse", start + date_us, total - date_us, NULL);
+        }
+        return NULL;
+}
+
+/* Start of the first task at or after OFFSET */
+static size_t
+next_task_start(const char *buf, size_t size, size_t offset)
+{
+        const char *c;
+
+        if (offset == 0)
+                return 0;
+        for (c = buf + offset - 1; (c = memchr(c, '\n', buf + size - c)); c++)
+                if (c + 1 < buf + size && c[1] == '[')
+                        return c + 1 - buf;
+        return size;
+}
+
+/* Parse FILENAME into the empty store S */
+static int
+load_store(Task_store *s, const char *filename)
+{
+        char *buf = NULL;
+        size_t size = 0;
+        size_t capacity = 0;
+        struct load_chunk chunks[LOAD_THREADS] = { 0 };
+        pthread_t threads[LOAD_THREADS];
+        bool started[LOAD_THREADS] = { 0 };
+        long nchunks;
+        int total = 0;
+        ssize_t n;
+        int fd;
+        uint64_t start = monotonic_us();
+        uint64_t io_start = start;
+        char args[64];
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+                LOG("File %s can not be opened! You should create it\n", filename);
+                return 0;
+        }
+        do {
+                if (capacity - size < 64 * 1024) {
+                        capacity = capacity ? capacity * 2 : 1024 * 1024;
+                        buf = realloc(buf, capacity);
+                        assert(buf);
+                }
+                n = read(fd, buf + size, capacity - size);
+                if (n > 0)
+                        size += n;
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        if (n < 0)
+                LOG("File %s: read failed: %s\n", filename, strerror(errno));
+        close(fd);
+        /* Ends the last line, there is always room left */
+        buf[size] = 0;
+        TRACE_END("load_from_file/io", io_start);
+
+        nchunks = size / LOAD_CHUNK + 1;
+        if (nchunks > LOAD_THREADS)
+                nchunks = LOAD_THREADS;
+        if (nchunks > sysconf(_SC_NPROCESSORS_ONLN))
+                nchunks = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nchunks < 1)
+                nchunks = 1;
+
+        for (int k = 0; k < nchunks; k++) {
+                size_t lo = next_task_start(buf, size, size / nchunks * k);
+                size_t hi = k + 1 < nchunks ? next_task_start(buf, size, size / nchunks * (k + 1)) : size;
+                chunks[k] = (struct load_chunk) { .start = buf + lo, .size = hi > lo ? hi - lo : 0 };
+        }
+
+        /* Chunk 0 is parsed by this thread */
+        for (int k = 1; k < nchunks; k++)
+                started[k] = pthread_create(&threads[k], NULL, load_chunk, &chunks[k]) == 0;
+        load_chunk(&chunks[0]);
+        for (int k = 1; k < nchunks; k++) {
+                if (started[k])
+                        pthread_join(threads[k], NULL);
+                else
+                        load_chunk(&chunks[k]);
+        }
+
+        for (int k = 0; k < nchunks; k++)
+                total += chunks[k].tasks.size;
+        store_reserve(s, total);
+        for (int k = 0; k < nchunks; k++) {
+                for_da_each(p, chunks[k].tasks)
+                {
+                        p->task.tags = p->tags ? parse_tags(p->tags, true) : NULL;
+                        p->task.project = p->project ? intern(p->project, true) : 0;
+                        store_append(s, p->task);
+                }
+                da_destroy(&chunks[k].tasks);
+        }
+        free(buf);
+        store_sort(s);
+        s->dirty = false;
+
+        if (trace_fd >= 0) {
+                snprintf(args, sizeof args, "{\"tasks\":%d,\"chunks\":%ld}", s->size, nchunks);
+                trace_event("load_from_file", start, monotonic_us() - start, args);
+        }
+        return 1;
+}
+
+static int
+load_from_file(const char *filename)
+{
+        return load_store(&data, filename);
+}
+
+/* Files are saved by writing FILE.tmp, fsync()ing it and renaming it
+ * over FILE, so a crash leaves either the old or the new contents. An
+ * flock() on FILE.lock keeps CLI calls and the daemon from saving the
+ * same file at once. Devices and pipes, like -out_file /dev/stdout,
+ * are written in place. */
+struct save_file {
+        char path[PATH_MAX];
+        char tmp[PATH_MAX + 8]; /* empty if written in place */
+        int lock;
+};
+
+/* Take the lock of PATH, also for writers that append in place.
+ * Returns its descriptor or -1. */
+static int
+save_lock(const char *path)
+{
+        char lock[PATH_MAX + 8];
+        int fd;
+
+        snprintf(lock, sizeof lock, "%s.lock", path);
+        if ((fd = open(lock, O_WRONLY | O_CREAT, 0666)) < 0)
+                return -1;
+        if (flock(fd, LOCK_EX) < 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+/* Take the lock of FILENAME for a save, for callers that read it
+ * first. Returns false if it can not be taken. */
+static bool
+save_begin(struct save_file *sf, const char *filename)
+{
+        struct stat st;
+
+        /* A symlink stays, the file it points to is replaced */
+        if (!realpath(filename, sf->path))
+                snprintf(sf->path, sizeof sf->path, "%s", filename);
+        sf->lock = -1;
+        if (stat(sf->path, &st) == 0 && !S_ISREG(st.st_mode)) {
+                *sf->tmp = 0;
+                return true;
+        }
+        snprintf(sf->tmp, sizeof sf->tmp, "%s.tmp", sf->path);
+        return (sf->lock = save_lock(sf->path)) >= 0;
+}
+
+/* Give up SF, from save_begin(), without writing it */
+static void
+save_end(struct save_file *sf)
+{
+        if (sf->lock >= 0)
+                close(sf->lock);
+        sf->lock = -1;
+}
+
+/* Returns the descriptor to write the new contents of SF, from
+ * save_begin(), to, or -1 after save_end() */
+static int
+save_write(struct save_file *sf)
+{
+        struct stat st;
+        int fd;
+
+        if (!*sf->tmp)
+                return open(sf->path, O_WRONLY | O_TRUNC);
+        if ((fd = open(sf->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+                save_end(sf);
+                return -1;
+        }
+        if (stat(sf->path, &st) == 0)
+                fchmod(fd, st.st_mode & 07777);
+        return fd;
+}
+
+/* Returns the descriptor to write the new contents to, or -1 */
+static int
+save_open(struct save_file *sf, const char *filename)
+{
+        return save_begin(sf, filename) ? save_write(sf) : -1;
+}
+
+/* Make FD, from save_open() or save_write(), the new file if OK,
+ * else drop it */
+static bool
+save_commit(struct save_file *sf, int fd, bool ok)
+{
+        char dir[PATH_MAX];
+        char *slash;
+        int dirfd;
+        int error = 0;
+
+        if (!*sf->tmp)
+                return close(fd) == 0 && ok;
+        if (ok && fsync(fd) < 0)
+                error = errno;
+        if (close(fd) < 0 && !error)
+                error = errno;
+        if (ok && !error && rename(sf->tmp, sf->path) < 0)
+                error = errno;
+
+        if (!ok || error) {
+                if (error)
+                        LOG("File %s can not be saved: %s\n", sf->path, strerror(error));
+                unlink(sf->tmp);
+        } else {
+                /* The rename is only durable once the directory is */
+                snprintf(dir, sizeof dir, "%s", sf->path);
+                if ((slash = strrchr(dir, '/')))
+                        slash[slash == dir] = 0;
+                else
+                        strcpy(dir, ".");
+                if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0) {
+                        fsync(dirfd);
+                        close(dirfd);
+                }
+        }
+        save_end(sf);
+        return ok && !error;
+}
+
+static int
+load_to_file(const char *filename)
+{
+        Outbuf ob = { 0 };
+        struct save_file sf;
+        bool ok;
+        uint64_t start = monotonic_us();
+        ob.fd = save_open(&sf, filename);
+
+        if (ob.fd < 0) {
+                LOG("File %s can not be opened to write!\n", filename);
+                return 0;
+        }
+
+        for (int i = 0; i < data.size; i++) {
+                ob_printf(&ob, "[%s]\n", data.name[i]);
+                ob_printf(&ob, "  date: %s\n", format_due(data.due[i]));
+                if (data.desc[i])
+                        ob_printf(&ob, "  desc: %s\n", data.desc[i]);
+                if (data.every[i])
+                        ob_printf(&ob, "  every: %s\n", format_every(data.every[i]));
+                if (data.project[i])
+                        ob_printf(&ob, "  project: %s\n", symbol_name(data.project[i]));
+                if (data.tags[i]) {
+                        ob_puts(&ob, "  tags: ");
+                        ob_tags(&ob, data.tags[i]);
+                        ob_puts(&ob, "\n");
+                }
+                ob_puts(&ob, "\n");
+        }
+
+        /* A failed write on the way makes the file incomplete */
+        if (!(ok = ob.error == 0 && ob_flush(&ob) == 0))
+                LOG("File %s: write failed: %s\n", filename, strerror(ob.error));
+        if (save_commit(&sf, ob.fd, ok))
+                data.dirty = false;
+        ob_destroy(&ob);
+        TRACE_END("load_to_file", start);
+        return data.size;
+}
+
+/* ---------- Import and export (-import, -export) ---------- */
+
+/* iCalendar (RFC 5545) VTODO and CSV (RFC 4180) files, chosen by the
+ * extension: .ics is iCalendar, anything else CSV. Both sides stream,
+ * a record at a time, so memory does not grow with the file. Imported
+ * tasks are appended and the store is sorted once at the end.
+ *
+ * iCalendar: SUMMARY, DESCRIPTION, DUE (DTSTART if there is no DUE),
+ * RRULE (FREQ and INTERVAL), CATEGORIES (tags) and X-TODO-PROJECT.
+ * Completed VTODOs are skipped.
+ * CSV: a header naming the columns name, due, desc, every, project and
+ * tags (any order, other columns are ignored), or no header and that
+ * order. Dates are ISO 8601 local time, or UTC with a trailing Z. */
+
+typedef DA(char) Char_da;
+typedef DA(int) Offset_da;
+
+static bool
+is_ical(const char *filename)
+{
+        const char *dot = strrchr(filename, '.');
+        return dot && (strcasecmp(dot, ".ics") == 0 || strcasecmp(dot, ".ical") == 0);
+}
+
+/* ISO 8601 in basic (20261019T120000Z) or extended (2026-10-19 12:00:00)
+ * form, or DATETIME_FORMAT. A date without time is the end of that
+ * day, a trailing Z means UTC and the rest is local time. */
+static bool
+parse_iso_date(const char *str, time_t *t)
+{
+        struct tm tp = { .tm_hour = 23, .tm_min = 59, .tm_sec = 59 };
+        int n = 0;
+        char *c;
+
+        while (isspace((unsigned char) *str))
+                ++str;
+        if (sscanf(str, "%4d-%2d-%2d%n", &tp.tm_year, &tp.tm_mon, &tp.tm_mday, &n) == 3 ||
+            sscanf(str, "%4d%2d%2d%n", &tp.tm_year, &tp.tm_mon, &tp.tm_mday, &n) == 3) {
+                str += n;
+                if ((*str == 'T' || *str == ' ') && isdigit((unsigned char) str[1])) {
+                        tp.tm_sec = 0;
+                        if (sscanf(str + 1, "%2d:%2d:%2d%n", &tp.tm_hour, &tp.tm_min, &tp.tm_sec, &n) == 3 ||
+                            sscanf(str + 1, "%2d:%2d%n", &tp.tm_hour, &tp.tm_min, &n) == 2 ||
+                            sscanf(str + 1, "%2d%2d%2d%n", &tp.tm_hour, &tp.tm_min, &tp.tm_sec, &n) == 3)
+                                str += n + 1;
+                        else
+                                return false;
+                }
+                tp.tm_year -= 1900;
+                tp.tm_mon -= 1;
+                if (*str == 'Z') {
+                        *t = utc_mktime(&tp);
+                        return true;
+                }
+                tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
+                *t = mktime(&tp);
+                return true;
+        }
+
+        ZERO(&tp);
+        if ((c = strptime(str, DATETIME_FORMAT, &tp)) == NULL)
+                return false;
+        tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
+        *t = mktime(&tp);
+        return true;
+}
+
+/* Task fields are stored one per line */
+static char *
+strdup_line(const char *str)
+{
+        char *dup = strdup(str);
+        for (char *c = dup; *c; c++)
+                if (*c == '\n' || *c == '\r')
+                        *c = ' ';
+        return dup;
+}
+
+/* Undo the iCalendar TEXT escapes in place */
+static void
+ical_unescape(char *str)
+{
+        char *out = str;
+        for (; *str; str++) {
+                if (*str == '\\' && str[1]) {
+                        ++str;
+                        *out++ = *str == 'n' || *str == 'N' ? '\n' : *str;
+                } else
+                        *out++ = *str;
+        }
+        *out = 0;
+}
+
+/* FREQ=...;INTERVAL=N as an every value, 0 if it does not map */
+static int
+ical_parse_rrule(const char *rule)
+{
+        const char *c;
+        int interval = 1;
+
+        if ((c = strstr(rule, "INTERVAL=")))
+                interval = atoi(c + 9);
+        if (interval <= 0 || (c = strstr(rule, "FREQ=")) == NULL)
+                return 0;
+        c += 5;
+        if (strncmp(c, "DAILY", 5) == 0)
+                return interval;
+        if (strncmp(c, "WEEKLY", 6) == 0)
+                return 7 * interval;
+        if (strncmp(c, "MONTHLY", 7) == 0)
+                return -interval;
+        if (strncmp(c, "YEARLY", 6) == 0)
+                return -12 * interval;
+        return 0;
+}
+
+/* Read one content line into LINE, without the line break. Lines
+ * starting with a space or a tab continue the previous one. */
+static bool
+ical_read_line(FILE *f, Char_da *line)
+{
+        int c;
+
+        line->size = 0;
+        if ((c = getc(f)) == EOF)
+                return false;
+        for (; c != EOF; c = getc(f)) {
+                if (c == '\n') {
+                        if ((c = getc(f)) == ' ' || c == '\t')
+                                continue;
+                        if (c != EOF)
+                                ungetc(c, f);
+                        break;
+                }
+                if (c != '\r')
+                        da_append(line, c);
+        }
+        da_append(line, 0);
+        return true;
+}
+
+static int
+import_ical(FILE *f)
+{
+        Char_da line = { 0 };
+        Task task = { 0 };
+        bool in_todo = false;
+        bool completed = false;
+        bool has_due = false;
+        int count = 0;
+        int skipped = 0;
+
+        while (ical_read_line(f, &line)) {
+                char *name = line.data;
+                char *value = strchr(name, ':');
+                char *params;
+
+                if (!value)
+                        continue;
+                *value++ = 0;
+                if ((params = strchr(name, ';')))
+                        *params++ = 0;
+
+                if (strcasecmp(name, "BEGIN") == 0 && strcasecmp(value, "VTODO") == 0) {
+                        task_free(task);
+                        ZERO(&task);
+                        in_todo = true;
+                        completed = has_due = false;
+                        continue;
+                }
+                if (!in_todo)
+                        continue;
+
+                if (strcasecmp(name, "END") == 0 && strcasecmp(value, "VTODO") == 0) {
+                        in_todo = false;
+                        if (completed || !task.name || !task.due) {
+                                ++skipped;
+                                continue;
+                        }
+                        undo_record(UNDO_IMPORT, UNDO_INSERT, task);
+                        store_append(&data, task);
+                        ZERO(&task);
+                        ++count;
+                } else if (strcasecmp(name, "SUMMARY") == 0) {
+                        ical_unescape(value);
+                        free(task.name);
+                        task.name = strdup_line(value);
+                } else if (strcasecmp(name, "DESCRIPTION") == 0) {
+                        ical_unescape(value);
+                        free(task.desc);
+                        task.desc = *value ? strdup_line(value) : NULL;
+                } else if (strcasecmp(name, "DUE") == 0 ||
+                           (strcasecmp(name, "DTSTART") == 0 && !has_due)) {
+                        /* TZID= dates are taken as local time */
+                        if (parse_iso_date(value, &task.due))
+                                has_due = strcasecmp(name, "DUE") == 0;
+                } else if (strcasecmp(name, "RRULE") == 0) {
+                        task.every = ical_parse_rrule(value);
+                } else if (strcasecmp(name, "CATEGORIES") == 0) {
+                        uint32_t *tags = parse_tags(value, true);
+                        /* Several CATEGORIES lines add up */
+                        if (task.tags && tags) {
+                                int n = 0;
+                                int m = 0;
+                                while (task.tags[n])
+                                        ++n;
+                                while (tags[m])
+                                        ++m;
+                                task.tags = realloc(task.tags, (n + m + 1) * sizeof *task.tags);
+                                assert(task.tags);
+                                memcpy(task.tags + n, tags, (m + 1) * sizeof *tags);
+                                qsort(task.tags, n + m, sizeof *task.tags, compare_u32);
+                                int unique = 0;
+                                for (int i = 0; i < n + m; i++)
+                                        if (i == 0 || task.tags[i] != task.tags[unique - 1])
+                                                task.tags[unique++] = task.tags[i];
+                                task.tags[unique] = 0;
+                                free(tags);
+                        } else if (tags)
+                                task.tags = tags;
+                } else if (strcasecmp(name, "X-TODO-PROJECT") == 0) {
+                        ical_unescape(value);
+                        task.project = *value ? intern(value, true) : 0;
+                } else if (strcasecmp(name, "STATUS") == 0) {
+                        completed = strcasecmp(value, "COMPLETED") == 0 || strcasecmp(value, "CANCELLED") == 0;
+                } else if (strcasecmp(name, "COMPLETED") == 0) {
+                        completed = true;
+                }
+        }
+
+        task_free(task);
+        da_destroy(&line);
+        if (skipped)
+                LOG("Import: skipped %d completed or incomplete VTODOs\n", skipped);
+        return count;
+}
+
+/* Read one CSV record. Fields are stored in TEXT, each NUL terminated,
+ * and START has the offset of each one. */
+static bool
+csv_read_record(FILE *f, Char_da *text, Offset_da *start)
+{
+        bool quoted = false;
+        int c;
+
+        text->size = 0;
+        start->size = 0;
+        if ((c = getc(f)) == EOF)
+                return false;
+        ungetc(c, f);
+        da_append(start, 0);
+
+        for (;;) {
+                c = getc(f);
+                if (quoted) {
+                        if (c == EOF)
+                                break;
+                        if (c == '"') {
+                                if ((c = getc(f)) != '"') {
+                                        quoted = false;
+                                        if (c != EOF)
+                                                ungetc(c, f);
+                                        continue;
+                                }
+                        }
+                        da_append(text, c);
+                        continue;
+                }
+                if (c == '"')
+                        quoted = true;
+                else if (c == ',') {
+                        da_append(text, 0);
+                        da_append(start, text->size);
+                } else if (c == '\n' || c == EOF)
+                        break;
+                else if (c != '\r')
+                        da_append(text, c);
+        }
+        da_append(text, 0);
+        return true;
+}
+
+enum { CSV_NAME, CSV_DUE, CSV_DESC, CSV_EVERY, CSV_PROJECT, CSV_TAGS, CSV_COLUMNS };
+static const char *csv_columns[CSV_COLUMNS] = { "name", "due", "desc", "every", "project", "tags" };
+
+static int
+import_csv(FILE *f)
+{
+        Char_da text = { 0 };
+        Offset_da start = { 0 };
+        int column[CSV_COLUMNS];
+        bool header = true;
+        int count = 0;
+        int skipped = 0;
+
+        for (int k = 0; k < CSV_COLUMNS; k++)
+                column[k] = k;
+
+        while (csv_read_record(f, &text, &start)) {
+                const char *field[CSV_COLUMNS] = { 0 };
+                Task task = { 0 };
+
+                /* A header if the first record names a column */
+                if (header) {
+                        header = false;
+                        bool named = false;
+                        for (int k = 0; k < CSV_COLUMNS; k++) {
+                                column[k] = -1;
+                                for (int i = 0; i < start.size; i++)
+                                        if (strcasecmp(text.data + start.data[i], csv_columns[k]) == 0)
+                                                column[k] = i;
+                                named |= column[k] >= 0;
+                        }
+                        if (named)
+                                continue;
+                        for (int k = 0; k < CSV_COLUMNS; k++)
+                                column[k] = k;
+                }
+
+                for (int k = 0; k < CSV_COLUMNS; k++)
+                        if (column[k] >= 0 && column[k] < start.size)
+                                field[k] = text.data + start.data[column[k]];
+
+                if (!field[CSV_NAME] || !*field[CSV_NAME] || !field[CSV_DUE] ||
+                    !parse_iso_date(field[CSV_DUE], &task.due)) {
+                        /* Blank lines are not worth a warning */
+                        skipped += start.size > 1 || text.size > 1;
+                        continue;
+                }
+                task.name = strdup_line(field[CSV_NAME]);
+                if (field[CSV_DESC] && *field[CSV_DESC])
+                        task.desc = strdup_line(field[CSV_DESC]);
+                if (field[CSV_EVERY] && *field[CSV_EVERY] && !parse_every(field[CSV_EVERY], &task.every))
+                        LOG("Import: can not parse repeat: %s\n", field[CSV_EVERY]);
+                if (field[CSV_PROJECT] && *field[CSV_PROJECT])
+                        task.project = intern(field[CSV_PROJECT], true);
+                if (field[CSV_TAGS])
+                        task.tags = parse_tags(field[CSV_TAGS], true);
+                undo_record(UNDO_IMPORT, UNDO_INSERT, task);
+                store_append(&data, task);
+                ++count;
+        }
+
+        da_destroy(&text);
+        da_destroy(&start);
+        if (skipped)
+                LOG("Import: skipped %d records without name or valid due date\n", skipped);
+        return count;
+}
+
+/* Add the tasks of FILENAME ("-" for stdin) to DATA. Returns how many. */
+static int
+import_tasks(const char *filename)
+{
+        uint64_t start = monotonic_us();
+        FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+        int count;
+
+        if (f == NULL) {
+                LOG("File %s can not be opened!\n", filename);
+                return 0;
+        }
+        count = is_ical(filename) ? import_ical(f) : import_csv(f);
+        if (f != stdin)
+                fclose(f);
+        store_sort(&data);
+        TRACE_END("import", start);
+        return count;
+}
+
+/* Write a content line folded at 75 bytes, not splitting UTF-8
+ * sequences. VALUE is escaped as TEXT if ESCAPE. */
+static void
+ob_ical_line(Outbuf *ob, const char *name, const char *value, bool escape)
+{
+        static _Thread_local Char_da line;
+        size_t begin = 0;
+
+        line.size = 0;
+        for (const char *c = name; *c; c++)
+                da_append(&line, *c);
+        da_append(&line, ':');
+        for (const char *c = value; *c; c++) {
+                if (escape && (*c == '\\' || *c == ';' || *c == ',' || *c == '\n')) {
+                        da_append(&line, '\\');
+                        da_append(&line, *c == '\n' ? 'n' : *c);
+                } else
+                        da_append(&line, *c);
+        }
+
+        while (line.size - begin > 75) {
+                size_t end = begin + (begin ? 74 : 75);
+                while (end > begin + 1 && ((unsigned char) line.data[end] & 0xc0) == 0x80)
+                        --end;
+                if (begin)
+                        ob_puts(ob, " ");
+                ob_write(ob, line.data + begin, end - begin);
+                ob_puts(ob, "\r\n");
+                begin = end;
+        }
+        if (begin)
+                ob_puts(ob, " ");
+        ob_write(ob, line.data + begin, line.size - begin);
+        ob_puts(ob, "\r\n");
+}
+
+static void
+export_ical(Outbuf *ob)
+{
+        char stamp[32];
+        char due[32];
+        time_t now = time(NULL);
+        struct tm tp;
+
+        strftime(stamp, sizeof stamp, "%Y%m%dT%H%M%SZ", gmtime_r(&now, &tp));
+        ob_puts(ob, "BEGIN:VCALENDAR\r\nVERSION:2.0\r\nPRODID:-//todo//todo//EN\r\n");
+        for (int i = 0; i < data.size; i++) {
+                strftime(due, sizeof due, "%Y%m%dT%H%M%SZ", gmtime_r(&data.due[i], &tp));
+                ob_puts(ob, "BEGIN:VTODO\r\n");
+                ob_printf(ob, "UID:%u-%lld@todo\r\n", data.id[i], (long long) data.due[i]);
+                ob_printf(ob, "DTSTAMP:%s\r\n", stamp);
+                ob_ical_line(ob, "SUMMARY", data.name[i], true);
+                ob_printf(ob, "DUE:%s\r\n", due);
+                if (data.desc[i])
+                        ob_ical_line(ob, "DESCRIPTION", data.desc[i], true);
+                if (data.every[i] > 0 && data.every[i] % 7 == 0)
+                        ob_printf(ob, "RRULE:FREQ=WEEKLY;INTERVAL=%d\r\n", data.every[i] / 7);
+                else if (data.every[i] > 0)
+                        ob_printf(ob, "RRULE:FREQ=DAILY;INTERVAL=%d\r\n", data.every[i]);
+                else if (data.every[i] < 0)
+                        ob_printf(ob, "RRULE:FREQ=MONTHLY;INTERVAL=%d\r\n", -data.every[i]);
+                if (data.tags[i]) {
+                        /* Commas separate the categories, only escape inside names */
+                        static _Thread_local Char_da list;
+                        list.size = 0;
+                        for (uint32_t *t = data.tags[i]; *t; t++) {
+                                if (t != data.tags[i])
+                                        da_append(&list, ',');
+                                for (const char *c = symbol_name(*t); *c; c++) {
+                                        if (*c == ',' || *c == ';' || *c == '\\')
+                                                da_append(&list, '\\');
+                                        da_append(&list, *c);
+                                }
+                        }
+                        da_append(&list, 0);
+                        ob_ical_line(ob, "CATEGORIES", list.data, false);
+                }
+                if (data.project[i])
+                        ob_ical_line(ob, "X-TODO-PROJECT", symbol_name(data.project[i]), true);
+                ob_puts(ob, "END:VTODO\r\n");
+        }
+        ob_puts(ob, "END:VCALENDAR\r\n");
+}
+
+/* Quote STR if it has a comma, quote or line break */
+static void
+ob_csv_field(Outbuf *ob, const char *str)
+{
+        if (!str)
+                return;
+        if (!str[strcspn(str, ",\"\r\n")]) {
+                ob_puts(ob, str);
+                return;
+        }
+        ob_puts(ob, "\"");
+        for (const char *c = str; *c; c++) {
+                if (*c == '"')
+                        ob_puts(ob, "\"");
+                ob_write(ob, c, 1);
+        }
+        ob_puts(ob, "\"");
+}
+
+static void
+export_csv(Outbuf *ob)
+{
+        Outbuf tags = { .fd = -1 };
+        char due[32];
+        struct tm tp;
+
+        ob_puts(ob, "name,due,desc,every,project,tags\r\n");
+        for (int i = 0; i < data.size; i++) {
+                strftime(due, sizeof due, "%Y-%m-%dT%H:%M:%S", localtime_r(&data.due[i], &tp));
+                ob_csv_field(ob, data.name[i]);
+                ob_printf(ob, ",%s,", due);
+                ob_csv_field(ob, data.desc[i]);
+                ob_printf(ob, ",%s,", data.every[i] ? format_every(data.every[i]) : "");
+                ob_csv_field(ob, data.project[i] ? symbol_name(data.project[i]) : NULL);
+                ob_puts(ob, ",");
+                tags.size = 0;
+                ob_tags(&tags, data.tags[i]);
+                ob_csv_field(ob, tags.size ? tags.data : NULL);
+                ob_puts(ob, "\r\n");
+        }
+        ob_destroy(&tags);
+}
+
+/* Write every task to FILENAME ("-" for stdout). Returns how many, or
+ * -1 if it can not be written, a partial file is removed. */
+static int
+export_tasks(const char *filename)
+{
+        uint64_t start = monotonic_us();
+        Outbuf ob = { .fd = strcmp(filename, "-") ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO };
+
+        bool ok;
+
+        if (ob.fd < 0) {
+                LOG("File %s can not be opened to write!\n", filename);
+                return -1;
+        }
+        if (is_ical(filename))
+                export_ical(&ob);
+        else
+                export_csv(&ob);
+        if (!(ok = ob.error == 0 && ob_flush(&ob) == 0))
+                LOG("File %s: write failed: %s\n", filename, strerror(ob.error));
+        if (ob.fd != STDOUT_FILENO && close(ob.fd) < 0 && ok) {
+                LOG("File %s: write failed: %s\n", filename, strerror(errno));
+                ok = false;
+        }
+        if (!ok && ob.fd != STDOUT_FILENO)
+                unlink(filename);
+        ob_destroy(&ob);
+        TRACE_END("export", start);
+        return ok ? data.size : -1;
+}
+
+/* ---------- Completed task archive ---------- */
+
+/* Done tasks are appended to ARCHIVE_FILENAME, away from the task file,
+ * so they never slow down loading. The file is a list of blocks:
+ *
+ *     header  "TDA1", count, min done, max done, payload size,
+ *             payload FNV-1a (0 if not checked)
+ *             (little endian u32, u32, i64, i64, u32, u32)
+ *     strings varint n, then n times varint length + bytes
+ *     records sorted by done time, each as varints:
+ *             done - previous done (the first one from min done),
+ *             due - done, name, desc + 1, every, project + 1,
+ *             number of tags, tags
+ *
+ * Times and every are zigzag encoded, strings are indices into the
+ * block string table, which holds each name, description, project and
+ * tag once. Range scans read only the headers of the blocks outside
+ * the range. Done tasks are buffered and appended as new blocks by
+ * archive_flush(), which never rewrites what is already there. Bytes
+ * that are not a block are logged and skipped up to the next one; a
+ * block cut short by a crash is cut off before the next append. Once
+ * more than ARCHIVE_COMPACT blocks have less than ARCHIVE_BLOCK
+ * records, archive_compact() rewrites the file in full blocks like the
+ * task file is saved. */
+
+#define ARCHIVE_MAGIC "TDA1"
+#define ARCHIVE_HEADER 32
+
+typedef struct {
+        Task task;
+        time_t done;
+} Archived;
+
+typedef DA(Archived) Archived_da;
+
+char **archive_file;
+static Archived_da archive_pending;
+
+struct archive_header {
+        uint32_t count;
+        time_t min_done;
+        time_t max_done;
+        uint32_t size;
+        uint32_t checksum;
+};
+
+static uint32_t
+archive_checksum(const void *data, size_t n)
+{
+        const uint8_t *p = data;
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++)
+                h = (h ^ p[i]) * 16777619u;
+        return h ? h : 1;
+}
+
+static void
+put_le(uint8_t *p, uint64_t x, int n)
+{
+        for (int i = 0; i < n; i++)
+                p[i] = x >> (8 * i);
+}
+
+static uint64_t
+get_le(const uint8_t *p, int n)
+{
+        uint64_t x = 0;
+        for (int i = 0; i < n; i++)
+                x |= (uint64_t) p[i] << (8 * i);
+        return x;
+}
+
+static void
+ob_varint(Outbuf *ob, uint64_t x)
+{
+        char buf[10];
+        int n = 0;
+        do {
+                buf[n++] = (x & 0x7f) | (x > 0x7f ? 0x80 : 0);
+                x >>= 7;
+        } while (x);
+        ob_write(ob, buf, n);
+}
+
+static inline uint64_t
+zigzag(int64_t x)
+{
+        return ((uint64_t) x << 1) ^ (uint64_t) (x >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t x)
+{
+        return (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+}
+
+/* Bounds checked reader over a block payload */
+struct archive_reader {
+        const uint8_t *c;
+        const uint8_t *end;
+        bool error;
+};
+
+static uint64_t
+read_varint(struct archive_reader *r)
+{
+        uint64_t x = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (r->c >= r->end)
+                        break;
+                x |= (uint64_t) (*r->c & 0x7f) << shift;
+                if ((*r->c++ & 0x80) == 0)
+                        return x;
+        }
+        r->error = true;
+        return 0;
+}
+
+/* Copy TASK, done at DONE, to be archived on archive_flush() */
+static void
+archive_add(Task task, time_t done)
+{
+        Archived a = { .task = task, .done = done };
+        int n = 0;
+
+        a.task.name = strdup(task.name);
+        a.task.desc = task.desc ? strdup(task.desc) : NULL;
+        if (task.tags) {
+                while (task.tags[n])
+                        ++n;
+                a.task.tags = malloc((n + 1) * sizeof *a.task.tags);
+                assert(a.task.tags);
+                memcpy(a.task.tags, task.tags, (n + 1) * sizeof *a.task.tags);
+        }
+        da_append(&archive_pending, a);
+}
+
+/* Index of STR in the block string table, adding it if new. TABLE is
+ * an open addressing set of indices + 1 of size CAPACITY. */
+struct string_table {
+        const char **strings;
+        int size;
+        int *slots;
+        int capacity; /* power of two */
+};
+
+static int
+string_table_index(struct string_table *t, const char *str)
+{
+        uint32_t i = symbol_hash(str) & (t->capacity - 1);
+
+        for (; t->slots[i]; i = (i + 1) & (t->capacity - 1))
+                if (strcmp(t->strings[t->slots[i] - 1], str) == 0)
+                        return t->slots[i] - 1;
+        t->strings[t->size] = str;
+        t->slots[i] = ++t->size;
+        return t->size - 1;
+}
+
+static int
+compare_archived(const void *a, const void *b)
+{
+        const Archived *ea = a;
+        const Archived *eb = b;
+        return (ea->done > eb->done) - (ea->done < eb->done);
+}
+
+/* Append the N entries of A (sorted by done time) as one block */
+static void
+archive_write_block(Outbuf *ob, const Archived *a, int n)
+{
+        struct string_table t = { 0 };
+        Outbuf payload = { .fd = -1 };
+        uint8_t header[ARCHIVE_HEADER] = ARCHIVE_MAGIC;
+        time_t prev;
+        int *idx;
+        int k = 0;
+
+        /* At most name, desc, project and the tags of each entry */
+        for (int i = 0; i < n; i++) {
+                t.size += 3;
+                for (uint32_t *tag = a[i].task.tags; tag && *tag; tag++)
+                        ++t.size;
+        }
+        t.capacity = 16;
+        while (t.capacity < t.size * 2)
+                t.capacity *= 2;
+        t.strings = malloc(t.size * sizeof *t.strings);
+        t.slots = calloc(t.capacity, sizeof *t.slots);
+        idx = malloc(t.size * sizeof *idx);
+        assert(t.strings && t.slots && idx);
+        t.size = 0;
+
+        for (int i = 0; i < n; i++) {
+                const Task *task = &a[i].task;
+                idx[k++] = string_table_index(&t, task->name);
+                idx[k++] = task->desc ? string_table_index(&t, task->desc) + 1 : 0;
+                idx[k++] = task->project ? string_table_index(&t, symbol_name(task->project)) + 1 : 0;
+                for (uint32_t *tag = task->tags; tag && *tag; tag++)
+                        idx[k++] = string_table_index(&t, symbol_name(*tag));
+        }
+
+        ob_varint(&payload, t.size);
+        for (int i = 0; i < t.size; i++) {
+                size_t len = strlen(t.strings[i]);
+                ob_varint(&payload, len);
+                ob_write(&payload, t.strings[i], len);
+        }
+
+        prev = a[0].done;
+        k = 0;
+        for (int i = 0; i < n; i++) {
+                const Task *task = &a[i].task;
+                int ntags = 0;
+                for (uint32_t *tag = task->tags; tag && *tag; tag++)
+                        ++ntags;
+                ob_varint(&payload, zigzag(a[i].done - prev));
+                ob_varint(&payload, zigzag(task->due - a[i].done));
+                ob_varint(&payload, idx[k++]);
+                ob_varint(&payload, idx[k++]);
+                ob_varint(&payload, zigzag(task->every));
+                ob_varint(&payload, idx[k++]);
+                ob_varint(&payload, ntags);
+                for (int j = 0; j < ntags; j++)
+                        ob_varint(&payload, idx[k++]);
+                prev = a[i].done;
+        }
+
+        put_le(header + 4, n, 4);
+        put_le(header + 8, a[0].done, 8);
+        put_le(header + 16, a[n - 1].done, 8);
+        put_le(header + 24, payload.size, 4);
+        put_le(header + 28, archive_checksum(payload.data, payload.size), 4);
+        ob_write(ob, (char *) header, sizeof header);
+        ob_write(ob, payload.data, payload.size);
+
+        ob_destroy(&payload);
+        free(t.strings);
+        free(t.slots);
+        free(idx);
+}
+
+/* Read the block header at OFFSET of FD. Returns false at the end of
+ * the file or if it is not a block. */
+static bool
+archive_read_header(int fd, off_t offset, struct archive_header *h)
+{
+        uint8_t header[ARCHIVE_HEADER];
+
+        if (pread(fd, header, sizeof header, offset) != sizeof header)
+                return false;
+        if (memcmp(header, ARCHIVE_MAGIC, 4) != 0)
+                return false;
+        h->count = get_le(header + 4, 4);
+        h->min_done = get_le(header + 8, 8);
+        h->max_done = get_le(header + 16, 8);
+        h->size = get_le(header + 24, 4);
+        h->checksum = get_le(header + 28, 4);
+        return true;
+}
+
+/* Offset of the first block magic of FD in [OFFSET, END), or END */
+static off_t
+archive_find_magic(int fd, off_t offset, off_t end)
+{
+        char buf[1 << 16];
+        ssize_t n;
+
+        while (offset + 4 <= end && (n = pread(fd, buf, sizeof buf, offset)) >= 4) {
+                for (ssize_t i = 0; i + 4 <= n; i++)
+                        if (memcmp(buf + i, ARCHIVE_MAGIC, 4) == 0)
+                                return offset + i;
+                offset += n - 3;
+        }
+        return end;
+}
+
+/* Find the first whole block of FD at or after *OFFSET, logging the
+ * bytes skipped to reach it. Returns false if there is none before
+ * END, with *OFFSET at END. */
+static bool
+archive_next_block(int fd, off_t *offset, off_t end, struct archive_header *h)
+{
+        off_t from = *offset;
+        bool found = false;
+
+        while (!found && *offset + ARCHIVE_HEADER <= end) {
+                found = archive_read_header(fd, *offset, h) && h->count > 0 &&
+                        h->size <= end - *offset - ARCHIVE_HEADER;
+                if (!found)
+                        *offset = archive_find_magic(fd, *offset + 1, end);
+        }
+        if (!found)
+                *offset = end;
+        if (*offset != from)
+                LOG("Archive: %lld bytes at offset %lld are not a block, skipped\n",
+                    (long long) (*offset - from), (long long) from);
+        return found;
+}
+
+static inline const char *
+archive_string(char **strings, uint64_t n, uint64_t i)
+{
+        return i < n && strings[i] ? strings[i] : "";
+}
+
+/* Decode the block at OFFSET and append its entries to OUT. Names of
+ * projects and tags are interned. */
+static bool
+archive_read_block(int fd, off_t offset, const struct archive_header *h, Archived_da *out)
+{
+        uint8_t *payload = malloc(h->size + 1);
+        struct archive_reader r = { .c = payload, .end = payload + h->size };
+        char **strings = NULL;
+        uint64_t nstrings;
+        time_t prev = h->min_done;
+        int size = out->size;
+
+        assert(payload);
+        if (pread(fd, payload, h->size, offset + ARCHIVE_HEADER) != (ssize_t) h->size ||
+            (h->checksum && h->checksum != archive_checksum(payload, h->size))) {
+                LOG("Archive: corrupt block at offset %lld\n", (long long) offset);
+                free(payload);
+                return false;
+        }
+
+        nstrings = read_varint(&r);
+        if (nstrings > h->size) {
+                r.error = true;
+                nstrings = 0;
+        }
+        strings = calloc(nstrings + 1, sizeof *strings);
+        assert(strings);
+        for (uint64_t i = 0; i < nstrings && !r.error; i++) {
+                uint64_t len = read_varint(&r);
+                if (len > (uint64_t) (r.end - r.c)) {
+                        r.error = true;
+                        break;
+                }
+                strings[i] = malloc(len + 1);
+                assert(strings[i]);
+                memcpy(strings[i], r.c, len);
+                strings[i][len] = 0;
+                r.c += len;
+        }
+
+        for (uint32_t i = 0; i < h->count && !r.error; i++) {
+                Archived a = { 0 };
+                uint64_t desc, project, ntags;
+
+                a.done = prev + unzigzag(read_varint(&r));
+                a.task.due = a.done + unzigzag(read_varint(&r));
+                a.task.name = strdup(archive_string(strings, nstrings, read_varint(&r)));
+                if ((desc = read_varint(&r)))
+                        a.task.desc = strdup(archive_string(strings, nstrings, desc - 1));
+                a.task.every = unzigzag(read_varint(&r));
+                if ((project = read_varint(&r)))
+                        a.task.project = intern(archive_string(strings, nstrings, project - 1), true);
+                if ((ntags = read_varint(&r)) > h->size)
+                        r.error = true;
+                else if (ntags) {
+                        a.task.tags = malloc((ntags + 1) * sizeof *a.task.tags);
+                        assert(a.task.tags);
+                        for (uint64_t j = 0; j < ntags; j++)
+                                a.task.tags[j] = intern(archive_string(strings, nstrings, read_varint(&r)), true);
+                        a.task.tags[ntags] = 0;
+                }
+                prev = a.done;
+                da_append(out, a);
+        }
+
+        for (uint64_t i = 0; i < nstrings; i++)
+                free(strings[i]);
+        free(strings);
+        free(payload);
+        if (r.error) {
+                LOG("Archive: corrupt block at offset %lld\n", (long long) offset);
+                for (int i = size; i < out->size; i++)
+                        task_free(out->data[i].task);
+                out->size = size;
+        }
+        return !r.error;
+}
+
+static void
+archived_destroy(Archived_da *a)
+{
+        for_da_each(e, *a)
+        {
+                task_free(e->task);
+        }
+        da_destroy(a);
+}
+
+/* Offset of FD just after its last block, reading only headers */
+static off_t
+archive_end(int fd, off_t size)
+{
+        struct archive_header h;
+        off_t offset = 0;
+        off_t end = 0;
+
+        while (archive_next_block(fd, &offset, size, &h))
+                end = offset += ARCHIVE_HEADER + h.size;
+        return end;
+}
+
+/* Append the pending done tasks to the archive file as new blocks.
+ * Returns whether they were written; if not, a partial append is cut
+ * off and they stay pending. */
+static bool
+archive_flush()
+{
+        uint64_t start = monotonic_us();
+        char path[PATH_MAX];
+        Outbuf ob = { 0 };
+        struct stat st;
+        off_t end = -1;
+        bool ok;
+        int lock;
+
+        if (archive_pending.size == 0 || !archive_file)
+                return false;
+
+        /* archive_compact() renames a new file over it under this lock */
+        if (!realpath(*archive_file, path))
+                snprintf(path, sizeof path, "%s", *archive_file);
+        if ((lock = save_lock(path)) < 0 || (ob.fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0666)) < 0) {
+                LOG("File %s can not be opened to write!\n", *archive_file);
+                if (lock >= 0)
+                        close(lock);
+                return false;
+        }
+
+        /* What follows the last block can not be read, it is the rest
+         * of an append cut short. New blocks must not land inside what
+         * its header claims. */
+        if (fstat(ob.fd, &st) == 0 && (end = archive_end(ob.fd, st.st_size)) < st.st_size) {
+                LOG("Archive: %lld bytes at the end are not a block, cut off\n", (long long) (st.st_size - end));
+                if (ftruncate(ob.fd, end) < 0)
+                        LOG("File %s: write failed: %s\n", *archive_file, strerror(errno));
+        }
+
+        qsort(archive_pending.data, archive_pending.size, sizeof *archive_pending.data, compare_archived);
+        for (int i = 0; i < archive_pending.size; i += ARCHIVE_BLOCK)
+                archive_write_block(&ob, archive_pending.data + i,
+                                    archive_pending.size - i < ARCHIVE_BLOCK ? archive_pending.size - i : ARCHIVE_BLOCK);
+        ok = ob.error == 0 && ob_flush(&ob) == 0;
+        if (!ok) {
+                LOG("File %s: write failed: %s\n", *archive_file, strerror(ob.error));
+                if (end >= 0 && ftruncate(ob.fd, end) < 0)
+                        LOG("File %s: write failed: %s\n", *archive_file, strerror(errno));
+        }
+        close(ob.fd);
+        close(lock);
+        ob_destroy(&ob);
+        if (ok)
+                archived_destroy(&archive_pending);
+        TRACE_END("archive_flush", start);
+        return ok;
+}
+
+/* Walk the blocks of FD, reading them into ALL if not NULL. Returns
+ * the number of blocks with less than ARCHIVE_BLOCK records, or -1 if
+ * part of the file is not a block or a block can not be read. */
+static int
+archive_scan(int fd, Archived_da *all)
+{
+        struct archive_header h;
+        struct stat st;
+        off_t offset = 0;
+        off_t expect = 0;
+        int short_blocks = 0;
+        bool ok = true;
+
+        if (fstat(fd, &st) < 0)
+                return -1;
+        for (; archive_next_block(fd, &offset, st.st_size, &h); expect = offset += ARCHIVE_HEADER + h.size) {
+                ok = ok && offset == expect && (!all || archive_read_block(fd, offset, &h, all));
+                short_blocks += h.count < ARCHIVE_BLOCK;
+        }
+        return ok && offset == expect ? short_blocks : -1;
+}
+
+/* Rewrite the archive in full blocks once more than ARCHIVE_COMPACT
+ * are short. It is left alone if any part of it can not be read. */
+static void
+archive_compact()
+{
+        uint64_t start = monotonic_us();
+        Archived_da all = { 0 };
+        struct save_file sf;
+        Outbuf ob = { 0 };
+        int fd;
+        bool ok;
+
+        if (!archive_file || (fd = open(*archive_file, O_RDONLY)) < 0)
+                return;
+        ok = archive_scan(fd, NULL) > ARCHIVE_COMPACT;
+        close(fd);
+        if (!ok)
+                return;
+
+        /* Read again under the lock, appends wait for the rename */
+        if ((ob.fd = save_open(&sf, *archive_file)) < 0) {
+                LOG("File %s can not be opened to write!\n", *archive_file);
+                return;
+        }
+        if ((fd = open(sf.path, O_RDONLY)) >= 0) {
+                ok = archive_scan(fd, &all) >= 0;
+                close(fd);
+        }
+        if (fd < 0 || !ok)
+                LOG("Archive: %s can not be read, not compacted\n", *archive_file);
+        else {
+                qsort(all.data, all.size, sizeof *all.data, compare_archived);
+                for (int i = 0; i < all.size; i += ARCHIVE_BLOCK)
+                        archive_write_block(&ob, all.data + i, all.size - i < ARCHIVE_BLOCK ? all.size - i : ARCHIVE_BLOCK);
+                if (!(ok = ob.error == 0 && ob_flush(&ob) == 0))
+                        LOG("File %s: write failed: %s\n", *archive_file, strerror(ob.error));
+        }
+        save_commit(&sf, ob.fd, fd >= 0 && ok);
+        ob_destroy(&ob);
+        archived_destroy(&all);
+        TRACE_END("archive_compact", start);
+}
+
+/* Entries of the archive done in [LO, HI], sorted by done time */
+static Archived_da
+archive_between(time_t lo, time_t hi)
+{
+        uint64_t start = monotonic_us();
+        Archived_da found = { 0 };
+        Archived_da block = { 0 };
+        struct archive_header h;
+        struct stat st;
+        off_t offset = 0;
+        int fd;
+
+        if ((fd = open(*archive_file, O_RDONLY)) < 0)
+                return found;
+        if (fstat(fd, &st) < 0)
+                st.st_size = 0;
+
+        while (archive_next_block(fd, &offset, st.st_size, &h)) {
+                block.size = 0;
+                if (h.max_done < lo || h.min_done > hi) {
+                        offset += ARCHIVE_HEADER + h.size;
+                        continue;
+                }
+                /* A bad block may hide good ones, look past its header */
+                if (!archive_read_block(fd, offset, &h, &block)) {
+                        ++offset;
+                        continue;
+                }
+                offset += ARCHIVE_HEADER + h.size;
+                for_da_each(a, block)
+                {
+                        if (a->done >= lo && a->done <= hi)
+                                da_append(&found, *a);
+                        else
+                                task_free(a->task);
+                }
+        }
+        close(fd);
+        da_destroy(&block);
+
+        /* Blocks are in write order, which is not always done order */
+        qsort(found.data, found.size, sizeof *found.data, compare_archived);
+        TRACE_END("archive_between", start);
+        return found;
+}
+
+static time_t days(unsigned int days);
+
+/* List the tasks done in the last DAYS_AGO days (0 is today) */
+static void
+list_finished(int days_ago)
+{
+        Outbuf ob = { .fd = STDOUT_FILENO };
+        time_t lo = days(0) - (time_t) (days_ago + 1) * 3600 * 24 + 1;
+        Archived_da found = archive_between(lo, time(NULL));
+        char done[DATETIME_MAXLEN];
+
+        if (!*quiet && days_ago == 0)
+                ob_puts(&ob, "Tasks done today:\n");
+        else if (!*quiet)
+                ob_printf(&ob, "Tasks done in the last %d days:\n", days_ago);
+        for_da_each(a, found)
+        {
+                strftime(done, sizeof done, DATETIME_FORMAT, localtime(&a->done));
+                ob_printf(&ob, "%s: %s (due %s)", done, a->task.name, overload_date(a->task.due));
+                if (a->task.project)
+                        ob_printf(&ob, " @%s", symbol_name(a->task.project));
+                for (uint32_t *t = a->task.tags; t && *t; t++)
+                        ob_printf(&ob, " #%s", symbol_name(*t));
+                if (a->task.desc)
+                        ob_printf(&ob, ": %s\n", a->task.desc);
+                else
+                        ob_puts(&ob, "\n");
+        }
+        if (found.size == 0 && !*quiet)
+                ob_puts(&ob, "  Nothing done yet.\n");
+        ob_flush(&ob);
+        ob_destroy(&ob);
+        archived_destroy(&found);
+}
+
+/* ---------- Undo log (-undo, -redo) ---------- */
+
+/* Every command (or daemon request) that changes the tasks records one
+ * group of primitive operations: a task was inserted or removed (a
+ * repeating task moving on is a remove and an insert). Undo applies the
+ * inverse of the last group, redo applies it again. Tasks are matched
+ * by content, as rows and ids do not survive a reload. The file keeps
+ * the last UNDO_DEPTH groups:
+ *
+ *     "TDU1", varint cursor (groups before it can be undone, the rest
+ *     redone), varint groups, then each group as varint size + bytes:
+ *     varint kind, zigzag time, varint records, and for each record
+ *     varint op, zigzag due (from the previous record), name, desc,
+ *     zigzag every, project, varint tags and the tags. Strings are
+ *     varint length + 1 and the bytes, 0 is no string.
+ *
+ * The daemon only changes the task file on Save, so it keeps the groups
+ * of its changes in UNDO_UNSAVED, which its undo and redo buttons walk,
+ * and adds the ones not undone to the file when it saves. */
+
+#define UNDO_MAGIC "TDU1"
+
+static const char *undo_kind_names[] = { "add", "done", "clear", "import" };
+
+typedef struct {
+        char *data;
+        size_t size;
+} Undo_group;
+
+typedef struct {
+        Undo_group *groups;
+        int size;
+        int cursor;
+} Undo_log;
+
+char **undo_file;
+
+/* Group being recorded */
+static struct {
+        Outbuf records;
+        int count;
+        Undo_kind kind;
+        time_t prev_due;
+} undo_pending = { .records = { .fd = -1 } };
+
+/* Groups of the daemon's changes since its last save */
+static Undo_log undo_unsaved;
+
+static void
+ob_undo_string(Outbuf *ob, const char *str)
+{
+        size_t len = str ? strlen(str) : 0;
+        ob_varint(ob, str ? len + 1 : 0);
+        ob_write(ob, str ? str : "", len);
+}
+
+static char *
+read_undo_string(struct archive_reader *r)
+{
+        uint64_t len = read_varint(r);
+        char *str;
+
+        if (len-- == 0)
+                return NULL;
+        if (len > (uint64_t) (r->end - r->c)) {
+                r->error = true;
+                return NULL;
+        }
+        str = malloc(len + 1);
+        assert(str);
+        memcpy(str, r->c, len);
+        str[len] = 0;
+        r->c += len;
+        return str;
+}
+
+/* Record that TASK was inserted or removed (OP) by a KIND command */
+static void
+undo_record(Undo_kind kind, Undo_op op, Task task)
+{
+        Outbuf *ob = &undo_pending.records;
+        int ntags = 0;
+
+        if (!undo_file)
+                return;
+        if (undo_pending.count++ == 0) {
+                undo_pending.kind = kind;
+                undo_pending.prev_due = 0;
+        }
+        ob_varint(ob, op);
+        ob_varint(ob, zigzag(task.due - undo_pending.prev_due));
+        ob_undo_string(ob, task.name);
+        ob_undo_string(ob, task.desc);
+        ob_varint(ob, zigzag(task.every));
+        ob_undo_string(ob, task.project ? symbol_name(task.project) : NULL);
+        for (uint32_t *t = task.tags; t && *t; t++)
+                ++ntags;
+        ob_varint(ob, ntags);
+        for (uint32_t *t = task.tags; t && *t; t++)
+                ob_undo_string(ob, symbol_name(*t));
+        undo_pending.prev_due = task.due;
+}
+
+static void
+undo_log_destroy(Undo_log *log)
+{
+        for (int i = 0; i < log->size; i++)
+                free(log->groups[i].data);
+        free(log->groups);
+        ZERO(log);
+}
+
+static void
+undo_log_read(Undo_log *log)
+{
+        Outbuf file = { .fd = -1 };
+        struct archive_reader r;
+        char buf[4096];
+        ssize_t n;
+        uint64_t size;
+        int fd;
+
+        ZERO(log);
+        if ((fd = open(*undo_file, O_RDONLY)) < 0)
+                return;
+        while ((n = read(fd, buf, sizeof buf)) > 0)
+                ob_write(&file, buf, n);
+        close(fd);
+
+        r = (struct archive_reader) { .c = (uint8_t *) file.data, .end = (uint8_t *) file.data + file.size };
+        if (file.size < 4 || memcmp(file.data, UNDO_MAGIC, 4) != 0) {
+                if (file.size)
+                        LOG("Undo: %s is not an undo log\n", *undo_file);
+                ob_destroy(&file);
+                return;
+        }
+        r.c += 4;
+        log->cursor = read_varint(&r);
+        size = read_varint(&r);
+        log->groups = calloc(size + 1, sizeof *log->groups);
+        assert(log->groups);
+        for (uint64_t i = 0; i < size && !r.error; i++) {
+                uint64_t len = read_varint(&r);
+                if (len > (uint64_t) (r.end - r.c)) {
+                        r.error = true;
+                        break;
+                }
+                log->groups[i].data = malloc(len + 1);
+                assert(log->groups[i].data);
+                memcpy(log->groups[i].data, r.c, len);
+                log->groups[i].size = len;
+                log->size = i + 1;
+                r.c += len;
+        }
+        if (r.error)
+                LOG("Undo: %s is corrupt, keeping %d groups\n", *undo_file, log->size);
+        if (log->cursor > log->size)
+                log->cursor = log->size;
+        ob_destroy(&file);
+}
+
+/* Write LOG to the undo file, whose lock SF holds since it was read */
+static void
+undo_log_write(Undo_log *log, struct save_file *sf)
+{
+        Outbuf ob = { 0 };
+        bool ok;
+
+        ob.fd = save_write(sf);
+        if (ob.fd < 0) {
+                LOG("File %s can not be opened to write!\n", *undo_file);
+                return;
+        }
+        ob_puts(&ob, UNDO_MAGIC);
+        ob_varint(&ob, log->cursor);
+        ob_varint(&ob, log->size);
+        for (int i = 0; i < log->size; i++) {
+                ob_varint(&ob, log->groups[i].size);
+                ob_write(&ob, log->groups[i].data, log->groups[i].size);
+        }
+        if (!(ok = ob.error == 0 && ob_flush(&ob) == 0))
+                LOG("File %s: write failed: %s\n", *undo_file, strerror(ob.error));
+        save_commit(sf, ob.fd, ok);
+        ob_destroy(&ob);
+}
+
+/* Add group G to LOG, which takes it. Whatever could be redone is
+ * lost and the oldest groups are dropped past UNDO_DEPTH. */
+static void
+undo_log_push(Undo_log *log, Undo_group g)
+{
+        while (log->size > log->cursor)
+                free(log->groups[--log->size].data);
+        if (log->size >= UNDO_DEPTH) {
+                int drop = log->size - UNDO_DEPTH + 1;
+                for (int i = 0; i < drop; i++)
+                        free(log->groups[i].data);
+                memmove(log->groups, log->groups + drop, (log->size - drop) * sizeof *log->groups);
+                log->size -= drop;
+        }
+        log->groups = realloc(log->groups, (log->size + 1) * sizeof *log->groups);
+        assert(log->groups);
+        log->groups[log->size++] = g;
+        log->cursor = log->size;
+}
+
+/* The recorded group, which is reset */
+static Undo_group
+undo_take()
+{
+        Outbuf group = { .fd = -1 };
+
+        ob_varint(&group, undo_pending.kind);
+        ob_varint(&group, zigzag(time(NULL)));
+        ob_varint(&group, undo_pending.count);
+        ob_write(&group, undo_pending.records.data, undo_pending.records.size);
+        undo_pending.records.size = 0;
+        undo_pending.count = 0;
+        return (Undo_group) { .data = group.data, .size = group.size };
+}
+
+/* Add the recorded group to the log file */
+static void
+undo_commit()
+{
+        Undo_log log;
+        struct save_file sf;
+
+        if (!undo_file || undo_pending.count == 0)
+                return;
+        /* Held from the read, or groups of another call are lost */
+        if (!save_begin(&sf, *undo_file)) {
+                LOG("File %s can not be locked!\n", *undo_file);
+                free(undo_take().data);
+                return;
+        }
+        undo_log_read(&log);
+        undo_log_push(&log, undo_take());
+        undo_log_write(&log, &sf);
+        undo_log_destroy(&log);
+}
+
+/* Keep the recorded group of an unsaved daemon change */
+static void
+undo_stage()
+{
+        if (!undo_file || undo_pending.count == 0)
+                return;
+        undo_log_push(&undo_unsaved, undo_take());
+}
+
+/* Add the staged groups that are not undone to the log file, once the
+ * changes they record are saved */
+static void
+undo_commit_staged()
+{
+        Undo_log log;
+        struct save_file sf;
+
+        if (undo_unsaved.cursor > 0 && !save_begin(&sf, *undo_file)) {
+                LOG("File %s can not be locked!\n", *undo_file);
+        } else if (undo_unsaved.cursor > 0) {
+                undo_log_read(&log);
+                for (int i = 0; i < undo_unsaved.cursor; i++) {
+                        undo_log_push(&log, undo_unsaved.groups[i]);
+                        undo_unsaved.groups[i].data = NULL;
+                }
+                undo_log_write(&log, &sf);
+                undo_log_destroy(&log);
+        }
+        undo_log_destroy(&undo_unsaved);
+}
+
+/* Row of S equal to TASK, or -1 */
+static int
+store_find(Task_store *s, Task task)
+{
+        for (int row = store_upper_bound(s, task.due) - 1; row >= 0 && s->due[row] == task.due; row--) {
+                Task e = store_get(s, row);
+                int i = 0;
+                if (strcmp(e.name, task.name) || e.every != task.every || e.project != task.project)
+                        continue;
+                if ((e.desc == NULL) != (task.desc == NULL) || (e.desc && strcmp(e.desc, task.desc)))
+                        continue;
+                while (e.tags && task.tags && e.tags[i] && e.tags[i] == task.tags[i])
+                        ++i;
+                if ((e.tags ? e.tags[i] : 0) == (task.tags ? task.tags[i] : 0))
+                        return row;
+        }
+        return -1;
+}
+
+/* Apply OP on TASK to S, or its inverse if INVERSE. TASK is taken. */
+static bool
+undo_apply_op(Task_store *s, Undo_op op, Task task, bool inverse)
+{
+        int row;
+
+        if ((op == UNDO_INSERT) != inverse) {
+                store_insert(s, task);
+                return true;
+        }
+        row = store_find(s, task);
+        task_free(task);
+        if (row < 0)
+                return false;
+        store_remove(s, row);
+        return true;
+}
+
+/* Undo (or redo if REDO) the last group (next group) of LOG and move
+ * its cursor. Returns false if there is nothing to do. */
+static bool
+undo_log_apply(Task_store *s, Undo_log *log, bool redo)
+{
+        Undo_group *g;
+        struct archive_reader r;
+        Undo_kind kind;
+        Undo_op *ops;
+        Task *tasks;
+        uint64_t count;
+        time_t prev = 0;
+        int missing = 0;
+
+        if (redo ? log->cursor >= log->size : log->cursor == 0) {
+                if (!*quiet)
+                        printf("Nothing to %s\n", redo ? "redo" : "undo");
+                return false;
+        }
+
+        g = &log->groups[redo ? log->cursor : log->cursor - 1];
+        r = (struct archive_reader) { .c = (uint8_t *) g->data, .end = (uint8_t *) g->data + g->size };
+        kind = read_varint(&r);
+        read_varint(&r); /* time */
+        count = read_varint(&r);
+        if (count > g->size)
+                count = 0;
+        ops = malloc((count + 1) * sizeof *ops);
+        tasks = calloc(count + 1, sizeof *tasks);
+        assert(ops && tasks);
+
+        for (uint64_t i = 0; i < count && !r.error; i++) {
+                char *project;
+                uint64_t ntags;
+
+                ops[i] = read_varint(&r);
+                tasks[i].due = prev + unzigzag(read_varint(&r));
+                tasks[i].name = read_undo_string(&r);
+                tasks[i].desc = read_undo_string(&r);
+                tasks[i].every = unzigzag(read_varint(&r));
+                if ((project = read_undo_string(&r)))
+                        tasks[i].project = intern(project, true);
+                free(project);
+                if ((ntags = read_varint(&r)) > g->size)
+                        r.error = true;
+                else if (ntags) {
+                        tasks[i].tags = malloc((ntags + 1) * sizeof *tasks[i].tags);
+                        assert(tasks[i].tags);
+                        for (uint64_t j = 0; j < ntags; j++) {
+                                char *tag = read_undo_string(&r);
+                                tasks[i].tags[j] = intern(tag ? tag : "", true);
+                                free(tag);
+                        }
+                        tasks[i].tags[ntags] = 0;
+                        /* Sorted by id, which may differ from the recording run */
+                        qsort(tasks[i].tags, ntags, sizeof *tasks[i].tags, compare_u32);
+                }
+                prev = tasks[i].due;
+                if (!tasks[i].name)
+                        r.error = true;
+        }
+
+        if (r.error) {
+                LOG("Undo: corrupt entry in %s\n", *undo_file);
+                for (uint64_t i = 0; i < count; i++)
+                        task_free(tasks[i]);
+        } else {
+                /* Inverses go in reverse order */
+                for (uint64_t k = 0; k < count; k++) {
+                        uint64_t i = redo ? k : count - 1 - k;
+                        missing += !undo_apply_op(s, ops[i], tasks[i], !redo);
+                }
+                log->cursor += redo ? 1 : -1;
+                if (!*quiet)
+                        printf("%s %s (%d tasks)\n", redo ? "Redid" : "Undid",
+                               kind <= UNDO_IMPORT ? undo_kind_names[kind] : "?", (int) count);
+                if (missing)
+                        LOG("Undo: %d tasks were changed since and were not found\n", missing);
+        }
+
+        free(ops);
+        free(tasks);
+        return !r.error;
+}
+
+/* Undo (or redo if REDO) the last group (next group) of the log file */
+static bool
+undo(Task_store *s, bool redo)
+{
+        Undo_log log;
+        struct save_file sf;
+        bool ok;
+
+        if (!undo_file)
+                return false;
+        if (!save_begin(&sf, *undo_file)) {
+                LOG("File %s can not be locked!\n", *undo_file);
+                return false;
+        }
+        undo_log_read(&log);
+        if ((ok = undo_log_apply(s, &log, redo)))
+                undo_log_write(&log, &sf);
+        else
+                save_end(&sf);
+        undo_log_destroy(&log);
+        return ok;
+}
+
+/* ---------- Shared memory store ---------- */
+
+/* The daemon publishes a snapshot of DATA in the SHM_NAME segment
+ * whenever DATA is what the task file holds (loaded, saved or merged,
+ * never with unsaved changes), and CLI calls on the same task file
+ * copy it instead of parsing the file. Changes are still written to
+ * the file; the CLI then sends SIGHUP so the daemon merges and
+ * publishes them, see source_merge().
+ *
+ * The daemon is the only writer. SEQ is a seqlock: it is odd while
+ * a snapshot is being written, and readers retry if it was odd or
+ * changed while they were copying. The daemon holds an exclusive
+ * flock() on the segment while it runs, so a snapshot left by a dead
+ * one is not used even if its pid was given to another process. */
+
+#define SHM_MAGIC "TDS1"
+#define SHM_VERSION 2
+#define SHM_TRIES 16
+
+struct shm_header {
+        char magic[4];
+        uint32_t version;
+        _Atomic uint32_t seq;
+        pid_t pid;       /* daemon */
+        int64_t mtime_s; /* of SOURCE the last time DATA was loaded or saved */
+        int64_t mtime_ns;
+        uint64_t dev; /* and its inode then */
+        uint64_t ino;
+        uint64_t size;         /* snapshot bytes after the header */
+        char source[PATH_MAX]; /* realpath() of the task file */
+};
+
+static struct shm_header *shm_hdr = NULL; /* daemon only */
+static size_t shm_capacity;
+static int shm_fd = -1;
+static struct stat source_stat; /* of *in_file when DATA was last loaded or saved */
+
+static void
+shm_encode(Outbuf *ob)
+{
+        time_t prev = 0;
+        int ntags;
+
+        ob_varint(ob, symbols.size ? symbols.size - 1 : 0);
+        for (uint32_t id = 1; id < symbols.size; id++)
+                ob_undo_string(ob, symbol_name(id));
+        ob_varint(ob, data.size);
+        for (int i = 0; i < data.size; i++) {
+                ob_varint(ob, zigzag(data.due[i] - prev));
+                ob_undo_string(ob, data.name[i]);
+                ob_undo_string(ob, data.desc[i]);
+                ob_varint(ob, zigzag(data.every[i]));
+                ob_varint(ob, data.project[i]);
+                ntags = 0;
+                for (uint32_t *t = data.tags[i]; t && *t; t++)
+                        ++ntags;
+                ob_varint(ob, ntags);
+                for (uint32_t *t = data.tags[i]; t && *t; t++)
+                        ob_varint(ob, *t);
+                prev = data.due[i];
+        }
+}
+
+/* Fill the empty DATA and symbol table from a snapshot */
+static bool
+shm_decode(const uint8_t *buf, size_t size)
+{
+        struct archive_reader r = { .c = buf, .end = buf + size };
+        uint64_t nsym = read_varint(&r);
+        uint64_t n;
+        time_t prev = 0;
+        char *name;
+
+        for (uint64_t id = 1; id <= nsym && !r.error; id++) {
+                name = read_undo_string(&r);
+                if (!name || intern(name, true) != id)
+                        r.error = true;
+                free(name);
+        }
+        n = read_varint(&r);
+        for (uint64_t i = 0; i < n && !r.error; i++) {
+                Task task = { 0 };
+                uint64_t ntags;
+
+                task.due = prev += unzigzag(read_varint(&r));
+                task.name = read_undo_string(&r);
+                task.desc = read_undo_string(&r);
+                task.every = unzigzag(read_varint(&r));
+                task.project = read_varint(&r);
+                ntags = read_varint(&r);
+                if (!task.name || task.project > nsym || ntags > (uint64_t) (r.end - r.c))
+                        r.error = true;
+                else if (ntags) {
+                        task.tags = malloc((ntags + 1) * sizeof *task.tags);
+                        assert(task.tags);
+                        for (uint64_t k = 0; k < ntags; k++)
+                                if ((task.tags[k] = read_varint(&r)) == 0 || task.tags[k] > nsym)
+                                        r.error = true;
+                        task.tags[ntags] = 0;
+                }
+                if (r.error) {
+                        task_free(task);
+                        break;
+                }
+                store_append(&data, task);
+        }
+        if (r.error) {
+                store_destroy(&data);
+                symbols_destroy();
+                return false;
+        }
+        store_sort(&data);
+        data.dirty = false;
+        return true;
+}
+
+/* Whether the daemon that published the segment FD still runs */
+static bool
+shm_live(int fd)
+{
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+                flock(fd, LOCK_UN);
+                return false;
+        }
+        return errno == EWOULDBLOCK;
+}
+
+/* Copy the tasks of the daemon if it is running and FILENAME did not
+ * change since it loaded or saved it. Returns false if FILENAME has
+ * to be loaded instead. */
+static bool
+shm_load(const char *filename)
+{
+        const struct shm_header *h;
+        struct stat st;
+        struct stat file;
+        uint8_t *copy = NULL;
+        uint64_t size = 0;
+        uint32_t seq;
+        char path[PATH_MAX];
+        bool valid = false;
+        bool ok = false;
+        int fd;
+
+        if ((fd = shm_open(SHM_NAME, O_RDONLY, 0)) < 0)
+                return false;
+        if (!realpath(filename, path) || stat(path, &file) < 0 || !shm_live(fd)) {
+                close(fd);
+                return false;
+        }
+
+        for (int tries = 0; tries < SHM_TRIES; tries++) {
+                if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof *h)
+                        break;
+                h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (h == MAP_FAILED)
+                        break;
+                seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+                if (!(seq & 1)) {
+                        size = h->size;
+                        valid = memcmp(h->magic, SHM_MAGIC, 4) == 0 && h->version == SHM_VERSION &&
+                                size <= st.st_size - sizeof *h && strncmp(h->source, path, sizeof h->source) == 0 &&
+                                h->dev == file.st_dev && h->ino == file.st_ino &&
+                                h->mtime_s == file.st_mtim.tv_sec && h->mtime_ns == file.st_mtim.tv_nsec;
+                        if (valid) {
+                                copy = realloc(copy, size + 1);
+                                assert(copy);
+                                memcpy(copy, h + 1, size);
+                        }
+                        atomic_thread_fence(memory_order_acquire);
+                }
+                if (atomic_load_explicit(&h->seq, memory_order_relaxed) == seq && !(seq & 1)) {
+                        munmap((void *) h, st.st_size);
+                        ok = valid && shm_decode(copy, size);
+                        break;
+                }
+                munmap((void *) h, st.st_size);
+                sched_yield();
+        }
+        free(copy);
+        close(fd);
+        return ok;
+}
+
+/* Ask the daemon serving FILENAME to load it again */
+static void
+shm_notify(const char *filename)
+{
+        const struct shm_header *h;
+        char path[PATH_MAX];
+        pid_t pid = 0;
+        int fd;
+
+        /* The file was replaced, only its name still refers to it */
+        if (!realpath(filename, path) || (fd = shm_open(SHM_NAME, O_RDONLY, 0)) < 0)
+                return;
+        if (!shm_live(fd)) {
+                close(fd);
+                return;
+        }
+        h = mmap(NULL, sizeof *h, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (h == MAP_FAILED)
+                return;
+        if (memcmp(h->magic, SHM_MAGIC, 4) == 0 && h->version == SHM_VERSION &&
+            strncmp(h->source, path, sizeof h->source) == 0)
+                pid = h->pid;
+        munmap((void *) h, sizeof *h);
+        if (pid > 0)
+                kill(pid, SIGHUP);
+}
+
+/* Map at least SIZE snapshot bytes. The segment never shrinks, readers
+ * may still have the old size mapped. */
+static bool
+shm_map(size_t size)
+{
+        size_t capacity = shm_capacity ? shm_capacity : 64 * 1024;
+        struct stat st;
+        void *p;
+
+        while (capacity < size)
+                capacity *= 2;
+        if (fstat(shm_fd, &st) == 0 && (size_t) st.st_size > sizeof *shm_hdr + capacity)
+                capacity = st.st_size - sizeof *shm_hdr;
+        if (ftruncate(shm_fd, sizeof *shm_hdr + capacity) < 0) {
+                LOG("Error: can not resize %s: %s\n", SHM_NAME, strerror(errno));
+                return false;
+        }
+        p = mmap(NULL, sizeof *shm_hdr + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (p == MAP_FAILED) {
+                LOG("Error: can not map %s: %s\n", SHM_NAME, strerror(errno));
+                return false;
+        }
+        if (shm_hdr)
+                munmap(shm_hdr, sizeof *shm_hdr + shm_capacity);
+        shm_hdr = p;
+        shm_capacity = capacity;
+        return true;
+}
+
+/* Called by the daemon before its first shm_publish() */
+static void
+shm_create()
+{
+        int tries = 0;
+
+        if ((shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0600)) < 0) {
+                LOG("Error: can not open %s: %s\n", SHM_NAME, strerror(errno));
+                return;
+        }
+        /* CLI calls only hold it shared for a moment */
+        while (flock(shm_fd, LOCK_EX | LOCK_NB) < 0 && errno == EWOULDBLOCK && ++tries < 100)
+                usleep(10000);
+        if (tries == 100) {
+                LOG("Error: %s is used by another daemon\n", SHM_NAME);
+                close(shm_fd);
+                shm_fd = -1;
+                return;
+        }
+        if (!shm_map(0)) {
+                close(shm_fd);
+                shm_fd = -1;
+        }
+}
+
+/* Replace the snapshot with DATA, unless it has unsaved changes: the
+ * snapshot stands for the task file, whose mtime it carries */
+static void
+shm_publish()
+{
+        Outbuf ob = { .fd = -1 };
+        uint32_t seq;
+        char path[PATH_MAX];
+        uint64_t start = monotonic_us();
+
+        if (!shm_hdr || data.dirty)
+                return;
+        /* CLI calls may name the file another way */
+        if (!realpath(*in_file, path))
+                path[0] = 0;
+        shm_encode(&ob);
+        if (ob.size > shm_capacity && !shm_map(ob.size)) {
+                ob_destroy(&ob);
+                return;
+        }
+
+        /* A killed daemon may have left it odd */
+        seq = atomic_load_explicit(&shm_hdr->seq, memory_order_relaxed) | 1;
+        atomic_store_explicit(&shm_hdr->seq, seq, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(shm_hdr->magic, SHM_MAGIC, 4);
+        shm_hdr->version = SHM_VERSION;
+        shm_hdr->pid = getpid();
+        shm_hdr->mtime_s = source_stat.st_mtim.tv_sec;
+        shm_hdr->mtime_ns = source_stat.st_mtim.tv_nsec;
+        shm_hdr->dev = source_stat.st_dev;
+        shm_hdr->ino = source_stat.st_ino;
+        shm_hdr->size = ob.size;
+        memcpy(shm_hdr->source, path, sizeof shm_hdr->source);
+        memcpy(shm_hdr + 1, ob.data, ob.size);
+        atomic_store_explicit(&shm_hdr->seq, seq + 1, memory_order_release);
+
+        ob_destroy(&ob);
+        TRACE_END("shm_publish", start);
+}
+
+/* ---------- Merging external changes ---------- */
+
+/* The daemon follows the changes made to *in_file by CLI calls or an
+ * editor, see serve_watch(). Tasks have no id in the file, so they are
+ * keyed by a hash of their contents. SOURCE_KEYS are the keys of the
+ * file when DATA was last loaded from or saved to it. For each key
+ * whose count changed in the new version of the file DATA gets that
+ * many tasks, the other keys keep what DATA has, changes not saved
+ * yet included. Only those tasks are inserted or removed, so the ids
+ * and indexes of the rest stay. */
+
+struct row_key {
+        uint64_t key;
+        int row;
+};
+
+static struct {
+        uint64_t *keys; /* sorted, NULL until source_sync() */
+        int size;
+} source_keys;
+
+/* Bumped on every change of DATA in the daemon, see serve_etag() */
+static _Atomic uint64_t data_generation;
+
+/* FNV-1a */
+static uint64_t
+key_mix(uint64_t h, const void *p, size_t n)
+{
+        const uint8_t *c = p;
+        while (n--)
+                h = (h ^ *c++) * 1099511628211ull;
+        return h;
+}
+
+static uint64_t
+key_string(uint64_t h, const char *str)
+{
+        size_t len = str ? strlen(str) : SIZE_MAX;
+        h = key_mix(h, &len, sizeof len);
+        return str ? key_mix(h, str, len) : h;
+}
+
+static uint64_t
+task_key(Task task)
+{
+        uint64_t h = 14695981039346656037ull;
+
+        h = key_mix(h, &task.due, sizeof task.due);
+        h = key_string(h, task.name);
+        h = key_string(h, task.desc);
+        h = key_mix(h, &task.every, sizeof task.every);
+        h = key_mix(h, &task.project, sizeof task.project);
+        for (uint32_t *t = task.tags; t && *t; t++)
+                h = key_mix(h, t, sizeof *t);
+        return h;
+}
+
+static int
+compare_row_keys(const void *a, const void *b)
+{
+        const struct row_key *x = a;
+        const struct row_key *y = b;
+        if (x->key != y->key)
+                return x->key < y->key ? -1 : 1;
+        return x->row - y->row;
+}
+
+/* Keys of the rows of S, sorted. The caller frees them. */
+static struct row_key *
+store_keys(Task_store *s)
+{
+        struct row_key *keys = malloc((s->size + 1) * sizeof *keys);
+        assert(keys);
+        for (int i = 0; i < s->size; i++)
+                keys[i] = (struct row_key) { task_key(store_get(s, i)), i };
+        qsort(keys, s->size, sizeof *keys, compare_row_keys);
+        return keys;
+}
+
+static void
+source_set_keys(const struct row_key *keys, int n)
+{
+        source_keys.keys = realloc(source_keys.keys, (n + 1) * sizeof *source_keys.keys);
+        assert(source_keys.keys);
+        for (int i = 0; i < n; i++)
+                source_keys.keys[i] = keys[i].key;
+        source_keys.size = n;
+}
+
+/* DATA matches FILENAME, that was just loaded or saved */
+static void
+source_sync(const char *filename)
+{
+        struct row_key *keys;
+
+        if (!in_file || strcmp(filename, *in_file) != 0 || stat(filename, &source_stat) < 0)
+                return;
+        keys = store_keys(&data);
+        source_set_keys(keys, data.size);
+        free(keys);
+}
+
+/* Whether *in_file is not the one of source_sync(), its new stat in ST.
+ * A missing file is not a change, editors may be replacing it. */
+static bool
+source_changed(struct stat *st)
+{
+        if (stat(*in_file, st) < 0)
+                return false;
+        return st->st_mtim.tv_sec != source_stat.st_mtim.tv_sec || st->st_mtim.tv_nsec != source_stat.st_mtim.tv_nsec ||
+               st->st_ino != source_stat.st_ino || st->st_dev != source_stat.st_dev || st->st_size != source_stat.st_size;
+}
+
+/* Bring the changes made to *in_file into DATA. DATA_LOCK is held. */
+static void
+source_merge()
+{
+        Task_store fresh = { 0 };
+        struct row_key *now;
+        struct row_key *have;
+        struct stat st;
+        int *removed;
+        Task *added;
+        int nremoved = 0;
+        int nadded = 0;
+        int i = 0, j = 0, k = 0;
+        bool dirty = data.dirty;
+        uint64_t start = monotonic_us();
+
+        if (!source_keys.keys || !source_changed(&st) || !load_store(&fresh, *in_file))
+                return;
+        now = store_keys(&fresh);
+        have = store_keys(&data);
+        removed = malloc((data.size + 1) * sizeof *removed);
+        added = malloc((fresh.size + 1) * sizeof *added);
+        assert(removed && added);
+
+        while (i < source_keys.size || j < fresh.size) {
+                uint64_t key = j == fresh.size || (i < source_keys.size && source_keys.keys[i] < now[j].key) ?
+                               source_keys.keys[i] :
+                               now[j].key;
+                int was = 0, is = 0, in_data = 0;
+
+                while (i < source_keys.size && source_keys.keys[i] == key)
+                        ++i, ++was;
+                while (j + is < fresh.size && now[j + is].key == key)
+                        ++is;
+                while (k < data.size && have[k].key < key)
+                        ++k;
+                while (k + in_data < data.size && have[k + in_data].key == key)
+                        ++in_data;
+
+                if (is != was) {
+                        for (int x = is; x < in_data; x++)
+                                removed[nremoved++] = have[k + x].row;
+                        for (int x = in_data; x < is; x++) {
+                                int row = now[j + x].row;
+                                added[nadded++] = store_get(&fresh, row);
+                                /* Now owned by ADDED */
+                                fresh.name[row] = fresh.desc[row] = NULL;
+                                fresh.tags[row] = NULL;
+                        }
+                }
+                j += is;
+                k += in_data;
+        }
+
+        /* From the last row, so the others do not move */
+        qsort(removed, nremoved, sizeof *removed, compare_u32);
+        for (int x = nremoved - 1; x >= 0; x--)
+                store_remove(&data, removed[x]);
+        for (int x = 0; x < nadded; x++)
+                store_insert(&data, added[x]);
+        data.dirty = dirty;
+
+        source_stat = st;
+        source_set_keys(now, fresh.size);
+        if (nremoved || nadded) {
+                ++data_generation;
+                LOG("%s changed: %d tasks added, %d removed\n", *in_file, nadded, nremoved);
+        }
+        /* Also with no changes, the new mtime lets CLI calls use it.
+         * Not with unsaved changes, the file has not got them. */
+        shm_publish();
+
+        free(removed);
+        free(added);
+        free(now);
+        free(have);
+        store_destroy(&fresh);
+        TRACE_END("source_merge", start);
+}
+
+static void
+kill_self()
+{
+        static sem_t *sem = NULL;
+        pid_t pid;
+        int fd;
+
+        if (!sem) {
+                sem = sem_open("/todo_pid_file_sem", O_CREAT, 0600, 1);
+        }
+        assert(sem != SEM_FAILED);
+
+        sem_wait(sem);
+
+        fd = open(PID_FILENAME, O_RDONLY | O_CREAT, 0600);
+        assert(fd >= 0);
+        while (read(fd, &pid, sizeof pid) == sizeof pid) {
+                kill(pid, SIGTERM);
+        }
+        close(fd);
+
+        fd = open(PID_FILENAME, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+        assert(fd >= 0);
+        pid = getpid();
+        assert(write(fd, &pid, sizeof pid) == sizeof pid);
+        close(fd);
+
+        sem_post(sem);
+}
+
+/* Shared info between serve loop and serve_gen_response thread.
+ * It is allocated by the serve loop and freed by the thread. */
+struct serve_data {
+        struct sockaddr_in sock_in;
+        int clientfd;
+        int addr_len;
+};
+
+static Task_view tasks_between(time_t lo, time_t hi);
+static time_t next_sunday(int *d);
+static time_t end_of_month();
+
+/* Serve threads share DATA, requests are handled one at a time */
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Answer to a request, written by the backend that read it. Nothing
+ * is sent if HEADER_SIZE is 0. */
+struct serve_response {
+        char header[512];
+        size_t header_size;
+        Outbuf body;
+        char etag[96]; /* empty if it can not be cached */
+};
+
+/* Headers of BODY with the given Content-Type, and ETAG if not NULL */
+static void
+serve_ok(struct serve_response *res, const char *content_type, const char *etag)
+{
+        int n;
+
+        n = snprintf(res->header, sizeof res->header,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n",
+                     content_type, res->body.size);
+        if (etag)
+                n += snprintf(res->header + n, sizeof res->header - n, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+        n += snprintf(res->header + n, sizeof res->header - n, "\r\n");
+        res->header_size = n;
+        snprintf(res->etag, sizeof res->etag, "%s", etag ? etag : "");
+}
+
+static void
+serve_not_modified(struct serve_response *res, const char *etag)
+{
+        res->header_size = snprintf(res->header, sizeof res->header, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
+        res->body.size = 0;
+}
+
+/* Validator of the responses to GET requests. It changes with DATA
+ * (and the daemon, DATA_GENERATION starts at 0), the day, as the time
+ * frames move, and the CSS file. DATA_LOCK is not needed. */
+static void
+serve_etag(char *out, size_t size)
+{
+        struct stat st = { 0 };
+
+        stat(*css_file, &st);
+        snprintf(out, size, "\"%lx-%llx-%llx-%llx\"", (long) getpid(), (unsigned long long) data_generation,
+                 (unsigned long long) days(0), (unsigned long long) st.st_mtim.tv_sec);
+}
+
+/* Copy the value of header NAME of REQ into OUT. Returns false if it
+ * is not there. */
+static bool
+request_header(const char *req, const char *name, char *out, size_t size)
+{
+        size_t len = strlen(name);
+        size_t n;
+
+        for (const char *c = strstr(req, "\r\n"); c && c[2] != '\r'; c = strstr(c + 2, "\r\n")) {
+                if (strncasecmp(c + 2, name, len) || c[2 + len] != ':')
+                        continue;
+                c += 3 + len;
+                c += strspn(c, " \t");
+                n = strcspn(c, "\r\n");
+                if (n >= size)
+                        return false;
+                memcpy(out, c, n);
+                out[n] = 0;
+                return true;
+        }
+        return false;
+}
+
+/* Each acceptor (the main thread, a -shards thread or the io_uring
+ * loop) counts what it served, see /api/stats, and may keep the last
+ * pages it rendered. A page is served again while its ETag is the
+ * current one. The cache is per acceptor, so it needs no lock; the
+ * thread per request backend has none. */
+
+#define SHARDS_MAX 64
+#define RENDER_CACHE_BODY (1024 * 1024) /* bigger answers are not cached */
+
+struct render_entry {
+        char *target; /* path and query, NULL if empty */
+        struct serve_response res;
+};
+
+struct shard {
+        _Alignas(64) _Atomic uint64_t requests;
+        _Atomic uint64_t cache_hits;
+        _Atomic uint64_t not_modified;
+        _Atomic uint64_t bytes;
+        _Atomic uint64_t busy_us;
+        struct render_entry *cache; /* RENDER_CACHE entries or NULL */
+        int fd;
+};
+
+int *shard_count = NULL;
+static struct shard shards[SHARDS_MAX];
+static _Atomic int nshards = 1;
+static _Thread_local struct shard *serve_shard = &shards[0];
+
+static void
+render_cache_attach()
+{
+        if (serve_shard->cache)
+                return;
+        serve_shard->cache = calloc(RENDER_CACHE, sizeof *serve_shard->cache);
+        assert(serve_shard->cache);
+        for (int i = 0; i < RENDER_CACHE; i++)
+                serve_shard->cache[i].res.body.fd = -1;
+}
+
+static void
+render_cache_detach()
+{
+        if (!serve_shard->cache)
+                return;
+        for (int i = 0; i < RENDER_CACHE; i++) {
+                free(serve_shard->cache[i].target);
+                ob_destroy(&serve_shard->cache[i].res.body);
+        }
+        free(serve_shard->cache);
+        serve_shard->cache = NULL;
+}
+
+/* Cache entry of the target of the request line REQ, NULL if there is
+ * no cache */
+static struct render_entry *
+render_cache_slot(const char *req, const char **target, size_t *len)
+{
+        *target = req + strcspn(req, " ");
+        *target += **target == ' ';
+        *len = strcspn(*target, " \r\n");
+        if (!serve_shard->cache)
+                return NULL;
+        return &serve_shard->cache[key_mix(14695981039346656037ull, *target, *len) % RENDER_CACHE];
+}
+
+/* Copy the answer to REQ into RES if it is cached with ETAG */
+static bool
+render_cache_get(const char *req, const char *etag, struct serve_response *res)
+{
+        const char *target;
+        size_t len;
+        struct render_entry *e = render_cache_slot(req, &target, &len);
+
+        if (!e || !e->target || strlen(e->target) != len || memcmp(e->target, target, len) ||
+            strcmp(e->res.etag, etag))
+                return false;
+        memcpy(res->header, e->res.header, e->res.header_size);
+        res->header_size = e->res.header_size;
+        strcpy(res->etag, e->res.etag);
+        ob_write(&res->body, e->res.body.data, e->res.body.size);
+        return true;
+}
+
+static void
+render_cache_put(const char *req, const struct serve_response *res)
+{
+        const char *target;
+        size_t len;
+        struct render_entry *e = render_cache_slot(req, &target, &len);
+
+        if (!e || !*res->etag || res->body.size > RENDER_CACHE_BODY)
+                return;
+        free(e->target);
+        e->target = strndup(target, len);
+        memcpy(e->res.header, res->header, res->header_size);
+        e->res.header_size = res->header_size;
+        strcpy(e->res.etag, res->etag);
+        e->res.body.size = 0;
+        ob_write(&e->res.body, res->body.data, res->body.size);
+}
+
+static void
+ob_stats(Outbuf *ob)
+{
+        int n = atomic_load(&nshards);
+
+        ob_printf(ob, "{\"generation\":%llu,\"shards\":[", (unsigned long long) data_generation);
+        for (int i = 0; i < n; i++) {
+                struct shard *s = &shards[i];
+                ob_printf(ob, "%s{\"shard\":%d,\"requests\":%llu,\"cache_hits\":%llu,"
+                              "\"not_modified\":%llu,\"bytes\":%llu,\"busy_us\":%llu}",
+                          i ? "," : "", i, (unsigned long long) s->requests, (unsigned long long) s->cache_hits,
+                          (unsigned long long) s->not_modified, (unsigned long long) s->bytes,
+                          (unsigned long long) s->busy_us);
+        }
+        ob_puts(ob, "]}");
+}
+
+/* Copy the url-decoded value of NAME from the query string of the
+ * request line in REQ into OUT. Returns false if it is not there. */
+static bool
+query_param(const char *req, const char *name, char *out, size_t size)
+{
+        const char *end = req + strcspn(req, " \r\n");
+        const char *c;
+        size_t len = strlen(name);
+        size_t n = 0;
+        unsigned int hex;
+
+        /* Skip the method */
+        if (end == req || !*end)
+                return false;
+        req = end + 1;
+        end = req + strcspn(req, " \r\n");
+
+        for (c = strchr(req, '?'); c && c < end; c = strchr(c + 1, '&')) {
+                if (strncmp(c + 1, name, len) == 0 && c[len + 1] == '=')
+                        break;
+        }
+        if (!c || c >= end)
+                return false;
+
+        for (c += len + 2; c < end && *c != '&' && n + 1 < size; c++) {
+                if (*c == '+')
+                        out[n++] = ' ';
+                else if (*c == '%' && c + 2 < end && sscanf(c + 1, "%2x", &hex) == 1) {
+                        out[n++] = hex;
+                        c += 2;
+                } else
+                        out[n++] = *c;
+        }
+        out[n] = 0;
+        return true;
+}
+
+static void
+ob_json_string(Outbuf *ob, const char *str)
+{
+        ob_puts(ob, "\"");
+        for (; str && *str; str++) {
+                switch (*str) {
+                case '"':
+                        ob_puts(ob, "\\\"");
+                        break;
+                case '\\':
+                        ob_puts(ob, "\\\\");
+                        break;
+                case '\n':
+                        ob_puts(ob, "\\n");
+                        break;
+                default:
+                        if ((unsigned char) *str < 0x20)
+                                ob_printf(ob, "\\u%04x", *str);
+                        else
+                                ob_write(ob, str, 1);
+                }
+        }
+        ob_puts(ob, "\"");
+}
+
+/* JSON array with the rows of V: index (as used by -done and the Done
+ * buttons), name, due (epoch), date, desc, project, tags and every
+ * (days, negative for months) for repeating tasks */
+static void
+ob_json_tasks(Outbuf *ob, Task_view v)
+{
+        ob_puts(ob, "[");
+        for (int i = 0; i < v.size; i++) {
+                Task task = store_get(&data, v.rows[i]);
+                time_t due = view_due(&data, v, i);
+                ob_printf(ob, "%s{\"index\":%d,\"name\":", i ? "," : "", v.rows[i]);
+                ob_json_string(ob, task.name);
+                ob_printf(ob, ",\"due\":%lld,\"date\":", (long long) due);
+                ob_json_string(ob, overload_date(due));
+                if (task.every)
+                        ob_printf(ob, ",\"every\":%d", task.every);
+                if (task.project) {
+                        ob_puts(ob, ",\"project\":");
+                        ob_json_string(ob, symbol_name(task.project));
+                }
+                if (task.tags) {
+                        ob_puts(ob, ",\"tags\":[");
+                        for (uint32_t *t = task.tags; *t; t++) {
+                                ob_puts(ob, t == task.tags ? "" : ",");
+                                ob_json_string(ob, symbol_name(*t));
+                        }
+                        ob_puts(ob, "]");
+                }
+                if (task.desc) {
+                        ob_puts(ob, ",\"desc\":");
+                        ob_json_string(ob, task.desc);
+                }
+                ob_puts(ob, "}");
+        }
+        ob_puts(ob, "]\n");
+}
+
+/* Append STR to OB escaped as a query string value */
+static void
+ob_url_value(Outbuf *ob, const char *str)
+{
+        for (; *str; str++) {
+                if (isalnum((unsigned char) *str) || strchr("-_.", *str))
+                        ob_write(ob, str, 1);
+                else
+                        ob_printf(ob, "%%%02X", (unsigned char) *str);
+        }
+}
+
+/* Append STR to OB escaped as HTML text or attribute value */
+static void
+ob_html(Outbuf *ob, const char *str)
+{
+        const char *run = str;
+
+        for (; *str; str++) {
+                const char *entity = *str == '&' ? "&amp;" :
+                                     *str == '<' ? "&lt;" :
+                                     *str == '>' ? "&gt;" :
+                                     *str == '"' ? "&quot;" :
+                                     *str == '\'' ? "&#39;" :
+                                                    NULL;
+                if (entity) {
+                        ob_write(ob, run, str - run);
+                        ob_puts(ob, entity);
+                        run = str + 1;
+                }
+        }
+        ob_write(ob, run, str - run);
+}
+
+/* The ?tag= (comma separated) and ?project= filters of REQ. Unknown
+ * names match nothing. */
+static void
+request_tags(const char *req, uint32_t **tags, uint32_t *project)
+{
+        char value[256];
+
+        *tags = query_param(req, "tag", value, sizeof value) ? parse_tags(value, false) : NULL;
+        *project = 0;
+        if (query_param(req, "project", value, sizeof value) && *value)
+                if ((*project = intern(value, false)) == 0)
+                        *project = UINT32_MAX;
+}
+
+/* The tabs of the page, the time frames of -today, -week and -month */
+static const char *page_views[] = { "all", "day", "week", "month" };
+#define PAGE_VIEWS (int) (sizeof page_views / sizeof *page_views)
+
+/* What a page shows: the tag and project filters, a time frame and
+ * the first of its PAGE_SIZE entries. Links and forms keep it. */
+struct page_query {
+        uint32_t *tags;
+        uint32_t project;
+        int view;
+        int offset;
+};
+
+static void
+request_page(const char *req, struct page_query *q)
+{
+        char value[32];
+
+        request_tags(req, &q->tags, &q->project);
+        q->view = 0;
+        q->offset = 0;
+        if (query_param(req, "view", value, sizeof value))
+                for (int k = 0; k < PAGE_VIEWS; k++)
+                        if (strcmp(value, page_views[k]) == 0)
+                                q->view = k;
+        if (query_param(req, "offset", value, sizeof value) && atoi(value) > 0)
+                q->offset = atoi(value);
+}
+
+/* Tasks of the time frame of Q with its filters */
+static Task_view
+page_tasks(const struct page_query *q)
+{
+        Task_view v;
+
+        switch (q->view) {
+        case 1:
+                v = tasks_between(TIME_MIN, days(0));
+                break;
+        case 2:
+                v = tasks_between(TIME_MIN, next_sunday(NULL));
+                break;
+        case 3:
+                v = tasks_between(TIME_MIN, end_of_month());
+                break;
+        default:
+                v = view_all(&data);
+                break;
+        }
+        view_filter_tags(&data, &v, q->tags, q->project);
+        return v;
+}
+
+/* Query string of Q for VIEW, without the offset */
+static void
+ob_page_query(Outbuf *ob, const struct page_query *q, int view)
+{
+        ob_printf(ob, "view=%s", page_views[view]);
+        if (q->tags) {
+                ob_puts(ob, "&amp;tag=");
+                for (const uint32_t *t = q->tags; *t; t++) {
+                        if (t != q->tags)
+                                ob_puts(ob, ",");
+                        ob_url_value(ob, *t == UINT32_MAX ? "" : symbol_name(*t));
+                }
+        }
+        if (q->project && q->project != UINT32_MAX) {
+                ob_puts(ob, "&amp;project=");
+                ob_url_value(ob, symbol_name(q->project));
+        }
+}
+
+/* Keep the page in a form */
+static void
+ob_page_inputs(Outbuf *ob, const struct page_query *q)
+{
+        ob_printf(ob, "<input type=\"hidden\" name=\"view\" value=\"%s\">", page_views[q->view]);
+        if (q->offset)
+                ob_printf(ob, "<input type=\"hidden\" name=\"offset\" value=\"%d\">", q->offset);
+        if (q->tags) {
+                ob_puts(ob, "<input type=\"hidden\" name=\"tag\" value=\"");
+                for (const uint32_t *t = q->tags; *t; t++) {
+                        if (t != q->tags)
+                                ob_puts(ob, ", ");
+                        ob_html(ob, symbol_name(*t));
+                }
+                ob_puts(ob, "\">");
+        }
+        if (q->project && q->project != UINT32_MAX) {
+                ob_puts(ob, "<input type=\"hidden\" name=\"project\" value=\"");
+                ob_html(ob, symbol_name(q->project));
+                ob_puts(ob, "\">");
+        }
+}
+
+/* Links to every tag and project with the number of tasks in it */
+static void
+ob_tag_bar(Outbuf *ob, const struct page_query *q)
+{
+        const char *view = page_views[q->view];
+        int count;
+
+        ob_puts(ob, "<p class=\"tags\">");
+        ob_printf(ob, "<a href=\"/?view=%s\"%s>all</a>", view, !q->tags && !q->project ? " class=\"active\"" : "");
+        for (uint32_t sym = 1; sym < symbols.size; sym++) {
+                if ((count = tag_count(&data, sym, true)) > 0) {
+                        ob_printf(ob, " <a href=\"/?view=%s&amp;project=", view);
+                        ob_url_value(ob, symbol_name(sym));
+                        ob_printf(ob, "\"%s>@", sym == q->project ? " class=\"active\"" : "");
+                        ob_html(ob, symbol_name(sym));
+                        ob_printf(ob, " (%d)</a>", count);
+                }
+        }
+        for (uint32_t sym = 1; sym < symbols.size; sym++) {
+                if ((count = tag_count(&data, sym, false)) > 0) {
+                        ob_printf(ob, " <a href=\"/?view=%s&amp;tag=", view);
+                        ob_url_value(ob, symbol_name(sym));
+                        ob_printf(ob, "\"%s>#", has_tag(q->tags, sym) ? " class=\"active\"" : "");
+                        ob_html(ob, symbol_name(sym));
+                        ob_printf(ob, " (%d)</a>", count);
+                }
+        }
+        ob_puts(ob, "</p>");
+}
+
+/* Tabs for the time frames, keeping the filters */
+static void
+ob_view_tabs(Outbuf *ob, const struct page_query *q)
+{
+        ob_puts(ob, "<p class=\"views\">");
+        for (int k = 0; k < PAGE_VIEWS; k++) {
+                ob_puts(ob, k ? " <a href=\"/?" : "<a href=\"/?");
+                ob_page_query(ob, q, k);
+                ob_printf(ob, "\"%s>%s</a>", k == q->view ? " class=\"active\"" : "", page_views[k]);
+        }
+        ob_puts(ob, "</p>");
+}
+
+/* Prev / page X of Y / Next for the SIZE entries of the view */
+static void
+ob_pager(Outbuf *ob, const struct page_query *q, int size)
+{
+        int pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        if (pages <= 1)
+                return;
+        ob_puts(ob, "<p class=\"pager\">");
+        if (q->offset > 0) {
+                ob_puts(ob, "<a href=\"/?");
+                ob_page_query(ob, q, q->view);
+                ob_printf(ob, "&amp;offset=%d\">Prev</a> ", q->offset - PAGE_SIZE);
+        }
+        ob_printf(ob, "page %d of %d", q->offset / PAGE_SIZE + 1, pages);
+        if (q->offset + PAGE_SIZE < size) {
+                ob_puts(ob, " <a href=\"/?");
+                ob_page_query(ob, q, q->view);
+                ob_printf(ob, "&amp;offset=%d\">Next</a>", q->offset + PAGE_SIZE);
+        }
+        ob_puts(ob, "</p>");
+}
+
+/* The <dt>/<dd> entries K to K + PAGE_SIZE of V, each with its Done
+ * button. Also the body of /fragment for "Load more". */
+static void
+ob_task_entries(Outbuf *ob, const struct page_query *q, Task_view v)
+{
+        for (int k = q->offset; k < v.size && k < q->offset + PAGE_SIZE; k++) {
+                int i = v.rows[k];
+                ob_puts(ob, "<dt>");
+                ob_html(ob, data.name[i]);
+                ob_puts(ob, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
+                ob_printf(ob, "<input type=\"hidden\" name=\"button\" value=\"%d\">", i);
+                ob_page_inputs(ob, q);
+                ob_puts(ob, "<button type=\"submit\">Done</button>");
+                ob_puts(ob, "</form>");
+                ob_puts(ob, "<dd>");
+                ob_puts(ob, overload_date(view_due(&data, v, k)));
+                if (data.every[i])
+                        ob_printf(ob, " (repeats %s%s)", isdigit(*format_every(data.every[i])) ? "every " : "",
+                                  format_every(data.every[i]));
+                if (data.project[i]) {
+                        ob_printf(ob, " <a href=\"/?view=%s&amp;project=", page_views[q->view]);
+                        ob_url_value(ob, symbol_name(data.project[i]));
+                        ob_puts(ob, "\">@");
+                        ob_html(ob, symbol_name(data.project[i]));
+                        ob_puts(ob, "</a>");
+                }
+                for (uint32_t *t = data.tags[i]; t && *t; t++) {
+                        ob_printf(ob, " <a href=\"/?view=%s&amp;tag=", page_views[q->view]);
+                        ob_url_value(ob, symbol_name(*t));
+                        ob_puts(ob, "\">#");
+                        ob_html(ob, symbol_name(*t));
+                        ob_puts(ob, "</a>");
+                }
+                ob_puts(ob, "</dd>");
+                if (data.desc[i]) {
+                        ob_puts(ob, "<dd><p>");
+                        ob_html(ob, data.desc[i]);
+                        ob_puts(ob, "\n");
+                        ob_puts(ob, "</p></dd>");
+                }
+        }
+}
+
+/* Appends the next page of entries to the list without a reload */
+static const char load_more_script[] =
+"<script>"
+"function more(b){"
+"fetch('/fragment?'+b.dataset.query+'&offset='+b.dataset.next)"
+".then(r=>r.text()).then(h=>{"
+"document.getElementById('tasks').insertAdjacentHTML('beforeend',h);"
+"b.dataset.next=+b.dataset.next+ +b.dataset.step;"
+"if(+b.dataset.next>=+b.dataset.total)b.remove();});}"
+"</script>";
+
+/* Render the answer to BUF into RES. It gets an ETag if CACHEABLE. */
+static void
+serve_render(const char *buf, struct serve_response *res, bool cacheable)
+{
+        char query[256];
+        char etag[96];
+        char css[4096];
+        Outbuf *page = &res->body;
+        struct page_query q = { 0 };
+        int clicked_elem_index;
+        int fd;
+        int n;
+        uint64_t start = monotonic_us();
+
+        pthread_mutex_lock(&data_lock);
+        if (cacheable)
+                serve_etag(etag, sizeof etag);
+        if (strncmp(buf, "GET /api/search?", 16) == 0) {
+                /* JSON list of the tasks matching ?q= */
+                if (!query_param(buf, "q", query, sizeof query))
+                        *query = 0;
+                Task_view found = search_query(&data, query);
+                ob_json_tasks(page, found);
+                view_destroy(&found);
+                pthread_mutex_unlock(&data_lock);
+                serve_ok(res, "application/json", etag);
+                TRACE_END("request/search", start);
+                return;
+        }
+        if (strncmp(buf, "GET /api/tasks", 14) == 0) {
+                /* JSON list of the tasks due in [?from=, ?to=] (epoch
+                 * seconds), with the occurrences of repeating ones */
+                time_t from = TIME_MIN;
+                time_t to = TIME_MAX;
+                if (query_param(buf, "from", query, sizeof query))
+                        from = strtoll(query, NULL, 10);
+                if (query_param(buf, "to", query, sizeof query))
+                        to = strtoll(query, NULL, 10);
+                request_tags(buf, &q.tags, &q.project);
+                Task_view found = tasks_between(from, to);
+                view_filter_tags(&data, &found, q.tags, q.project);
+                ob_json_tasks(page, found);
+                view_destroy(&found);
+                free(q.tags);
+                pthread_mutex_unlock(&data_lock);
+                serve_ok(res, "application/json", etag);
+                TRACE_END("request/tasks", start);
+                return;
+        }
+        if (strncmp(buf, "GET /fragment?", 14) == 0) {
+                /* The entries from ?offset= on, for "Load more" */
+                request_page(buf, &q);
+                Task_view shown = page_tasks(&q);
+                ob_task_entries(page, &q, shown);
+                view_destroy(&shown);
+                free(q.tags);
+                pthread_mutex_unlock(&data_lock);
+                serve_ok(res, "text/html", etag);
+                TRACE_END("request/fragment", start);
+                return;
+        }
+        if (sscanf(buf, "GET /?button=%d", &clicked_elem_index) == 1) {
+                switch (clicked_elem_index) {
+                default:
+                        /* Buttons from 0 to tasks num - 1 */
+                        task_done(&data, clicked_elem_index);
+                        archive_flush();
+                        undo_stage();
+                        ++data_generation;
+                        break;
+                case -2:
+                        undo_log_apply(&data, &undo_unsaved, false);
+                        ++data_generation;
+                        break;
+                case -3:
+                        undo_log_apply(&data, &undo_unsaved, true);
+                        ++data_generation;
+                        break;
+                case -1:
+                        /* Save button. Changes made to the file since
+                         * are merged first, not overwritten. */
+                        source_merge();
+                        load_to_file(*out_file);
+                        archive_compact();
+                        if (!data.dirty) {
+                                source_sync(*out_file);
+                                undo_commit_staged();
+                        }
+                        break;
+                }
+                shm_publish();
+        } else if (strncmp(buf, "GET /favicon.ico HTTP/1.1", 25) == 0) {
+                /* The client ask for the icon. As it is not needed,
+                 * return and dont send anything to the client. */
+                pthread_mutex_unlock(&data_lock);
+                return;
+        }
+
+        /* The page keeps its time frame, filters and offset, also after
+         * a Done button */
+        request_page(buf, &q);
+        TRACE_END("request/parse", start);
+        start = monotonic_us();
+
+        /* ---------- INLINE HTML ---------- */
+
+        ob_puts(page, "<!DOCTYPE html>");
+        ob_puts(page, "<html>");
+        ob_puts(page, "<head>");
+
+        /* Try to open and load CSS file directly into <style> ... </style>. */
+        fd = open(*css_file, O_RDONLY);
+        if (fd >= 0) {
+                ob_puts(page, "<style>");
+                while ((n = read(fd, css, sizeof css)) > 0)
+                        ob_write(page, css, n);
+                close(fd);
+                ob_puts(page, "</style>");
+        } else
+                LOG("Error: cant load css file '%s'\n", *css_file);
+
+        ob_puts(page, "</head>");
+        ob_puts(page, "<body>");
+        ob_puts(page, "<title>");
+        ob_puts(page, "Todo");
+        ob_puts(page, "</title>");
+        ob_puts(page, "<h1>");
+        ob_puts(page, "Tasks");
+        ob_puts(page, "</h1>");
+
+        ob_view_tabs(page, &q);
+        ob_tag_bar(page, &q);
+        Task_view shown = page_tasks(&q);
+        /* A Done button may have emptied the last page */
+        if (q.offset >= shown.size)
+                q.offset = shown.size ? (shown.size - 1) / PAGE_SIZE * PAGE_SIZE : 0;
+
+        ob_pager(page, &q, shown.size);
+        ob_puts(page, "<dl id=\"tasks\">");
+        ob_task_entries(page, &q, shown);
+        ob_puts(page, "</dl>");
+        if (q.offset + PAGE_SIZE < shown.size) {
+                ob_puts(page, "<button type=\"button\" onclick=\"more(this)\" data-query=\"");
+                ob_page_query(page, &q, q.view);
+                ob_printf(page, "\" data-next=\"%d\" data-step=\"%d\" data-total=\"%d\">Load more</button>",
+                          q.offset + PAGE_SIZE, PAGE_SIZE, shown.size);
+                ob_puts(page, load_more_script);
+        }
+        ob_pager(page, &q, shown.size);
+        view_destroy(&shown);
+        ob_puts(page, "<br>");
+        ob_puts(page, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
+        ob_printf(page, "<input type=\"hidden\" name=\"button\" value=\"%d\">", -1);
+        ob_puts(page, "<button type=\"submit\">Save</button>");
+        ob_puts(page, "</form>");
+        ob_puts(page, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
+        ob_printf(page, "<input type=\"hidden\" name=\"button\" value=\"%d\">", -2);
+        ob_page_inputs(page, &q);
+        ob_puts(page, "<button type=\"submit\">Undo</button>");
+        ob_puts(page, "</form>");
+        ob_puts(page, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
+        ob_printf(page, "<input type=\"hidden\" name=\"button\" value=\"%d\">", -3);
+        ob_page_inputs(page, &q);
+        ob_puts(page, "<button type=\"submit\">Redo</button>");
+        ob_puts(page, "</form>");
+        free(q.tags);
+        ob_puts(page, "</body>");
+        ob_puts(page, "</html>");
+
+        pthread_mutex_unlock(&data_lock);
+        serve_ok(res, "text/html", cacheable ? etag : NULL);
+        TRACE_END("request/render", start);
+}
+
+/* Answer the request BUF into RES, with any backend */
+static void
+serve_respond(const char *buf, struct serve_response *res)
+{
+        char etag[96];
+        char match[96];
+        bool cacheable;
+        uint64_t start = monotonic_us();
+
+        *res = (struct serve_response) { .body = { .fd = -1 } };
+        atomic_fetch_add_explicit(&serve_shard->requests, 1, memory_order_relaxed);
+
+        if (strncmp(buf, "GET /api/stats", 14) == 0) {
+                /* JSON counters of each acceptor */
+                ob_stats(&res->body);
+                serve_ok(res, "application/json", NULL);
+                return;
+        }
+
+        /* Anything but a button can be answered from the cache of the
+         * browser, or of this acceptor, while DATA does not change */
+        if ((cacheable = strncmp(buf, "GET /?button=", 13) != 0)) {
+                serve_etag(etag, sizeof etag);
+                if (request_header(buf, "If-None-Match", match, sizeof match) && strcmp(match, etag) == 0) {
+                        serve_not_modified(res, etag);
+                        atomic_fetch_add_explicit(&serve_shard->not_modified, 1, memory_order_relaxed);
+                        TRACE_END("request/not_modified", start);
+                        goto done;
+                }
+                if (render_cache_get(buf, etag, res)) {
+                        atomic_fetch_add_explicit(&serve_shard->cache_hits, 1, memory_order_relaxed);
+                        TRACE_END("request/cached", start);
+                        goto done;
+                }
+        }
+        serve_render(buf, res, cacheable);
+        render_cache_put(buf, res);
+
+done:
+        atomic_fetch_add_explicit(&serve_shard->bytes, res->header_size + res->body.size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&serve_shard->busy_us, monotonic_us() - start, memory_order_relaxed);
+}
+
+/* Read one request from FD into BUF and answer it into RES. Returns
+ * false, with FD closed, if there was none. */
+static bool
+serve_read(int fd, char *buf, size_t size, struct serve_response *res)
+{
+        ssize_t n;
+
+        switch (n = read(fd, buf, size - 1)) {
+        default:
+                buf[n] = 0;
+                serve_respond(buf, res);
+                return true;
+
+        case 0:
+        case -1:
+                LOG("Internal Server Error! Reload the page\n");
+                close(fd);
+                return false;
+        }
+}
+
+/* Send what is left of RES to the non-blocking FD, SENT bytes of it
+ * went out already. Returns 1 once all of it did, 0 if FD is full and
+ * -1 on errors. */
+static int
+serve_send(int fd, const struct serve_response *res, size_t *sent)
+{
+        struct iovec iov[2];
+        size_t head;
+        ssize_t n;
+
+        if (!res->header_size)
+                return 1;
+        while (*sent < res->header_size + res->body.size) {
+                head = *sent < res->header_size ? *sent : res->header_size;
+                iov[0] = (struct iovec) { .iov_base = (char *) res->header + head,
+                                          .iov_len = res->header_size - head };
+                iov[1] = (struct iovec) { .iov_base = res->body.data + (*sent - head),
+                                          .iov_len = res->body.size - (*sent - head) };
+                if ((n = writev(fd, iov, 2)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+                }
+                *sent += n;
+        }
+        return 1;
+}
+
+/* Read one request from FD into BUF, answer it and close FD */
+static void
+serve_connection(int fd, char *buf, size_t size)
+{
+        struct serve_response res;
+        struct iovec iov[2];
+        uint64_t start;
+
+        if (!serve_read(fd, buf, size, &res))
+                return;
+
+        /* Headers and body go out in a single writev */
+        start = monotonic_us();
+        iov[0] = (struct iovec) { .iov_base = res.header, .iov_len = res.header_size };
+        iov[1] = (struct iovec) { .iov_base = res.body.data, .iov_len = res.body.size };
+        if (res.header_size && writev_all(fd, iov, 2) < 0)
+                LOG("send: %s\n", strerror(errno));
+        ob_destroy(&res.body);
+        close(fd);
+        TRACE_END("request/send", start);
+}
+
+static void *
+serve_gen_response(void *args)
+{
+        struct serve_data sdata = *(struct serve_data *) args;
+        char buf[BUFSIZE];
+
+        free(args);
+
+        if (sdata.clientfd < 0) {
+                LOG("invalid clientfd\n");
+                return NULL;
+        }
+        serve_connection(sdata.clientfd, buf, sizeof buf);
+        return NULL;
+}
+
+/* Bind a socket to ADDR, trying ports from *PORT up to PORT + MAX_ATTEMPTS.
+ * On return *PORT holds the port in use. */
+static int
+serve_listen(in_addr_t addr, int *port)
+{
+        struct sockaddr_in sock_in;
+        int sockfd;
+
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(sockfd >= 0);
+
+        sock_in.sin_family = AF_INET;
+        sock_in.sin_addr.s_addr = htonl(addr);
+
+retry:
+        errno = 0;
+        sock_in.sin_port = htons(*port);
+
+        if (bind(sockfd, (struct sockaddr *) &sock_in, sizeof(struct sockaddr_in)) < 0) {
+                if (errno == EADDRINUSE) {
+                        ++*port;
+                        if (*port - PORT > MAX_ATTEMPTS) {
+                                perror("Bind max attempts");
+                                exit(1);
+                        }
+                        goto retry;
+                }
+                perror("Bind");
+                exit(1);
+        }
+
+        assert(listen(sockfd, MAX_CLIENTS) >= 0);
+        return sockfd;
+}
+
+static volatile sig_atomic_t reload_requested = 0;
+
+static void
+on_sighup(int sig)
+{
+        (void) sig;
+        reload_requested = 1;
+}
+
+/* A CLI call changed the task file, see shm_notify(). It is also
+ * seen by serve_watch(), the second merge finds no changes. */
+static void
+serve_reload()
+{
+        reload_requested = 0;
+        pthread_mutex_lock(&data_lock);
+        source_merge();
+        pthread_mutex_unlock(&data_lock);
+}
+
+/* Merge *in_file every time it is written or replaced. Without
+ * inotify the daemon still gets the SIGHUP of CLI calls. */
+static void *
+serve_watch(void *args)
+{
+        char path[PATH_MAX];
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        const char *base;
+        char *slash;
+        bool changed;
+        ssize_t n;
+        int fd;
+
+        (void) args;
+        /* Saves replace the file the symlink points to */
+        if (!realpath(*in_file, path))
+                snprintf(path, sizeof path, "%s", *in_file);
+        if ((slash = strrchr(path, '/'))) {
+                *slash = 0;
+                base = slash + 1;
+        } else {
+                memmove(path + 2, path, strlen(path) + 1);
+                memcpy(path, ".", 2);
+                base = path + 2;
+        }
+
+        /* The directory is watched, the file itself is replaced by
+         * renames (saves, most editors) */
+        if ((fd = inotify_init1(IN_CLOEXEC)) < 0 ||
+            inotify_add_watch(fd, *path ? path : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                LOG("Can not watch %s: %s\n", *in_file, strerror(errno));
+                if (fd >= 0)
+                        close(fd);
+                return NULL;
+        }
+
+        while ((n = read(fd, buf, sizeof buf)) > 0 || (n < 0 && errno == EINTR)) {
+                changed = false;
+                for (char *c = buf; n > 0 && c < buf + n; c += sizeof *ev + ev->len) {
+                        ev = (const struct inotify_event *) c;
+                        if (ev->len && strcmp(ev->name, base) == 0)
+                                changed = true;
+                }
+                if (changed) {
+                        pthread_mutex_lock(&data_lock);
+                        source_merge();
+                        pthread_mutex_unlock(&data_lock);
+                }
+        }
+        LOG("Stopped watching %s: %s\n", *in_file, strerror(errno));
+        close(fd);
+        return NULL;
+}
+
+/* ---------- io_uring backend (-uring) ---------- */
+
+/* With -uring the daemon runs one event loop on an io_uring instead of
+ * a thread per connection. A multishot accept gives the connections,
+ * requests are read into buffers registered with the ring, and the
+ * headers, the body and the close of each answer are linked, so they
+ * go out in a single submission. Requests are answered inline, they
+ * were handled one at a time under DATA_LOCK anyway.
+ * Reads are linked to a timeout, so idle clients do not keep the
+ * slots. The ring is set up with raw system calls (there is no
+ * liburing); if that fails the thread per connection loop is used. */
+
+bool *uring = NULL;
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 256
+#define URING_CONNS 64            /* connections open at once */
+#define URING_REQUEST (16 * 1024) /* biggest request read */
+
+enum {
+        URING_ACCEPT = 0,
+        URING_READ,
+        URING_TIMEOUT,
+        URING_HEADER,
+        URING_BODY,
+        URING_CLOSE,
+};
+
+struct uring {
+        int fd;
+        unsigned entries;
+        _Atomic unsigned *sq_head;
+        _Atomic unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        _Atomic unsigned *cq_head;
+        _Atomic unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *ring;
+        size_t ring_size;
+        unsigned tail;    /* of the submission queue, published by uring_enter() */
+        unsigned pending; /* entries not submitted yet */
+};
+
+struct uring_conn {
+        int fd; /* -1 if the slot is free */
+        struct serve_response res;
+        uint64_t start;
+};
+
+static bool
+uring_setup(struct uring *r)
+{
+        struct io_uring_params p = { .flags = IORING_SETUP_COOP_TASKRUN };
+        size_t sq_size;
+        size_t cq_size;
+        char *ring;
+
+        ZERO(r);
+        if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+                return false;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(r->fd);
+                errno = ENOSYS;
+                return false;
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+        r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+        r->sqes = mmap(NULL, p.sq_entries * sizeof *r->sqes, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES);
+        if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+                if (r->ring != MAP_FAILED)
+                        munmap(r->ring, r->ring_size);
+                close(r->fd);
+                return false;
+        }
+
+        ring = r->ring;
+        r->entries = p.sq_entries;
+        r->sq_head = (_Atomic unsigned *) (ring + p.sq_off.head);
+        r->sq_tail = (_Atomic unsigned *) (ring + p.sq_off.tail);
+        r->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *) (ring + p.sq_off.array);
+        r->cq_head = (_Atomic unsigned *) (ring + p.cq_off.head);
+        r->cq_tail = (_Atomic unsigned *) (ring + p.cq_off.tail);
+        r->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+        r->tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+        return true;
+}
+
+static void
+uring_destroy(struct uring *r)
+{
+        munmap(r->sqes, r->entries * sizeof *r->sqes);
+        munmap(r->ring, r->ring_size);
+        close(r->fd);
+}
+
+/* Submit the pending entries and wait for WAIT completions */
+static int
+uring_enter(struct uring *r, unsigned wait)
+{
+        int n;
+
+        atomic_store_explicit(r->sq_tail, r->tail, memory_order_release);
+        n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n > 0)
+                r->pending -= n;
+        return n;
+}
+
+/* Next submission entry, zeroed */
+static struct io_uring_sqe *
+uring_sqe(struct uring *r, int slot, int op)
+{
+        struct io_uring_sqe *sqe;
+        unsigned index;
+
+        if (r->tail - atomic_load_explicit(r->sq_head, memory_order_acquire) >= r->entries)
+                uring_enter(r, 0);
+        index = r->tail++ & *r->sq_mask;
+        ++r->pending;
+        r->sq_array[index] = index;
+        sqe = &r->sqes[index];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->user_data = (uint64_t) slot << 8 | op;
+        return sqe;
+}
+
+static void
+uring_accept(struct uring *r, int sockfd)
+{
+        struct io_uring_sqe *sqe = uring_sqe(r, 0, URING_ACCEPT);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = sockfd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Read the request of SLOT, canceled after IDLE_TIMEOUT */
+static void
+uring_read(struct uring *r, int slot, int fd, char *buf)
+{
+        static const struct __kernel_timespec timeout = { .tv_sec = IDLE_TIMEOUT };
+        struct io_uring_sqe *sqe = uring_sqe(r, slot, URING_READ);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t) buf;
+        sqe->len = URING_REQUEST - 1;
+        sqe->buf_index = slot;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_sqe(r, slot, URING_TIMEOUT);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (uintptr_t) &timeout;
+        sqe->len = 1;
+}
+
+/* Send the answer of C, if any, and close it. Sends only complete if
+ * they fail, which cancels the rest of the chain. */
+static void
+uring_respond(struct uring *r, int slot, struct uring_conn *c)
+{
+        struct io_uring_sqe *sqe;
+
+        if (c->res.header_size) {
+                sqe = uring_sqe(r, slot, URING_HEADER);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = c->fd;
+                sqe->addr = (uintptr_t) c->res.header;
+                sqe->len = c->res.header_size;
+                sqe->msg_flags = MSG_WAITALL | (c->res.body.size ? MSG_MORE : 0);
+                sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        }
+        if (c->res.header_size && c->res.body.size) {
+                sqe = uring_sqe(r, slot, URING_BODY);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = c->fd;
+                sqe->addr = (uintptr_t) c->res.body.data;
+                sqe->len = c->res.body.size;
+                sqe->msg_flags = MSG_WAITALL;
+                sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        }
+        sqe = uring_sqe(r, slot, URING_CLOSE);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = c->fd;
+}
+
+/* Serve SOCKFD until the daemon is killed. Returns if io_uring can not
+ * be used. */
+static void
+serve_uring(int sockfd)
+{
+        struct uring r;
+        struct uring_conn *conns;
+        struct iovec iov[URING_CONNS];
+        char *buffers;
+        bool accepted = false;
+        unsigned head;
+        unsigned tail;
+
+        if (!uring_setup(&r)) {
+                LOG("io_uring is not available (%s), using threads\n", strerror(errno));
+                return;
+        }
+        buffers = malloc(URING_CONNS * URING_REQUEST);
+        conns = calloc(URING_CONNS, sizeof *conns);
+        assert(buffers && conns);
+        for (int i = 0; i < URING_CONNS; i++) {
+                iov[i] = (struct iovec) { .iov_base = buffers + i * URING_REQUEST, .iov_len = URING_REQUEST };
+                conns[i].fd = -1;
+        }
+        if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, URING_CONNS) < 0) {
+                LOG("io_uring can not register buffers (%s), using threads\n", strerror(errno));
+                goto fallback;
+        }
+        uring_accept(&r, sockfd);
+
+        while (1) {
+                if (reload_requested)
+                        serve_reload();
+                if (uring_enter(&r, 1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG("io_uring_enter: %s, using threads\n", strerror(errno));
+                        goto fallback;
+                }
+
+                head = atomic_load_explicit(r.cq_head, memory_order_relaxed);
+                tail = atomic_load_explicit(r.cq_tail, memory_order_acquire);
+                for (; head != tail; head++) {
+                        struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+                        int slot = cqe->user_data >> 8;
+                        struct uring_conn *c = &conns[slot];
+                        char *buf = buffers + slot * URING_REQUEST;
+
+                        switch (cqe->user_data & 0xff) {
+                        case URING_ACCEPT:
+                                if (!(cqe->flags & IORING_CQE_F_MORE))
+                                        uring_accept(&r, sockfd);
+                                if (cqe->res < 0) {
+                                        /* No multishot accept before Linux 5.19 */
+                                        if (!accepted && cqe->res == -EINVAL) {
+                                                LOG("io_uring has no multishot accept, using threads\n");
+                                                goto fallback;
+                                        }
+                                        LOG("accept: %s\n", strerror(-cqe->res));
+                                        break;
+                                }
+                                accepted = true;
+                                for (slot = 0; slot < URING_CONNS && conns[slot].fd >= 0; slot++) {
+                                }
+                                if (slot == URING_CONNS) {
+                                        LOG("accept: more than %d connections\n", URING_CONNS);
+                                        close(cqe->res);
+                                        break;
+                                }
+                                conns[slot].fd = cqe->res;
+                                uring_read(&r, slot, cqe->res, buffers + slot * URING_REQUEST);
+                                break;
+
+                        case URING_READ:
+                                /* Timed out or closed, nothing to answer */
+                                if (cqe->res <= 0) {
+                                        if (cqe->res < 0 && cqe->res != -ECANCELED)
+                                                LOG("Internal Server Error! Reload the page\n");
+                                        c->res = (struct serve_response) { .body = { .fd = -1 } };
+                                } else {
+                                        buf[cqe->res] = 0;
+                                        serve_respond(buf, &c->res);
+                                }
+                                c->start = monotonic_us();
+                                uring_respond(&r, slot, c);
+                                break;
+
+                        case URING_TIMEOUT:
+                                break;
+
+                        case URING_HEADER:
+                        case URING_BODY:
+                                if (cqe->res < 0 && cqe->res != -ECANCELED)
+                                        LOG("send: %s\n", strerror(-cqe->res));
+                                break;
+
+                        case URING_CLOSE:
+                                /* Canceled by a failed send */
+                                if (cqe->res < 0)
+                                        close(c->fd);
+                                ob_destroy(&c->res.body);
+                                c->fd = -1;
+                                TRACE_END("request/send", c->start);
+                                break;
+                        }
+                }
+                atomic_store_explicit(r.cq_head, head, memory_order_release);
+        }
+
+fallback:
+        uring_destroy(&r);
+        for (int i = 0; i < URING_CONNS; i++) {
+                if (conns[i].fd >= 0) {
+                        close(conns[i].fd);
+                        ob_destroy(&conns[i].res.body);
+                }
+        }
+        free(conns);
+        free(buffers);
+}
+
+#else
+
+static void
+serve_uring(int sockfd)
+{
+        (void) sockfd;
+        LOG("io_uring was not built in (kernel headers older than 5.19), using threads\n");
+}
+
+#endif /* HAVE_IO_URING */
+
+/* ---------- Acceptor shards (-shards) ---------- */
+
+/* With -shards N the daemon has N acceptor threads, each with its own
+ * SO_REUSEPORT socket on the same port, and the kernel spreads the
+ * connections among them. Each one answers its requests inline (or
+ * with its own io_uring loop if -uring) and keeps its own page cache
+ * and counters. They still render one at a time under DATA_LOCK, but
+ * cached pages and 304s do not take it. Shard 0 is the main thread,
+ * it also handles SIGHUP.
+ *
+ * A shard polls its socket and the connections it accepted. It only
+ * reads a request once it arrived, and writes as much of the answer as
+ * the socket takes, the rest once it is writable again, so a client
+ * that does not send or does not read does not hold the others back.
+ * Clients that make no progress for IDLE_TIMEOUT seconds are dropped. */
+
+#define SHARD_CONNS 64 /* connections waiting for their request or answer */
+
+struct shard_conn {
+        struct serve_response res; /* once the request was read */
+        size_t sent;
+        uint64_t since; /* last progress */
+};
+
+static void *
+serve_shard_loop(void *args)
+{
+        struct pollfd fds[SHARD_CONNS + 1];
+        struct shard_conn *conns = calloc(SHARD_CONNS + 1, sizeof *conns);
+        char *buf = malloc(BUFSIZE);
+        int nfds = 1;
+        int clientfd;
+        int status;
+        uint64_t now;
+
+        assert(buf && conns);
+        serve_shard = args;
+        render_cache_attach();
+        if (uring && *uring)
+                serve_uring(serve_shard->fd);
+
+        /* Ready connections may be gone by the time accept() runs */
+        fcntl(serve_shard->fd, F_SETFL, fcntl(serve_shard->fd, F_GETFL) | O_NONBLOCK);
+        fds[0] = (struct pollfd) { .fd = serve_shard->fd, .events = POLLIN };
+
+        while (1) {
+                if (reload_requested)
+                        serve_reload();
+                if (poll(fds, nfds, nfds > 1 ? 1000 : -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG("poll: %s\n", strerror(errno));
+                        break;
+                }
+
+                /* From the last one, a finished slot takes the last entry */
+                now = monotonic_us();
+                for (int i = nfds - 1; i > 0; i--) {
+                        struct shard_conn *c = &conns[i];
+
+                        if (fds[i].revents && fds[i].events == POLLIN) {
+                                if (!serve_read(fds[i].fd, buf, BUFSIZE, &c->res))
+                                        goto drop;
+                                fds[i].events = POLLOUT;
+                                c->sent = 0;
+                        } else if (!fds[i].revents) {
+                                if (now - c->since < IDLE_TIMEOUT * 1000000ull)
+                                        continue;
+                                status = -1;
+                                errno = ETIMEDOUT;
+                                goto done;
+                        }
+                        if ((status = serve_send(fds[i].fd, &c->res, &c->sent)) == 0) {
+                                c->since = now;
+                                continue;
+                        }
+                done:
+                        if (status < 0)
+                                LOG("send: %s\n", strerror(errno));
+                        if (fds[i].events == POLLOUT)
+                                ob_destroy(&c->res.body);
+                        close(fds[i].fd);
+                drop:
+                        fds[i] = fds[--nfds];
+                        conns[i] = conns[nfds];
+                }
+
+                while ((fds[0].revents & POLLIN) && (clientfd = accept(serve_shard->fd, NULL, NULL)) >= 0) {
+                        if (nfds == SHARD_CONNS + 1) {
+                                LOG("accept: more than %d connections\n", SHARD_CONNS);
+                                close(clientfd);
+                                continue;
+                        }
+                        fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+                        fds[nfds] = (struct pollfd) { .fd = clientfd, .events = POLLIN };
+                        conns[nfds++].since = now;
+                }
+                if ((fds[0].revents & POLLIN) && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        LOG("accept: %s\n", strerror(errno));
+        }
+        free(conns);
+        free(buf);
+        return NULL;
+}
+
+/* Run the shards, SOCKFD is the one of shard 0. Returns if it fails. */
+static void
+serve_shards(int sockfd)
+{
+        struct sockaddr_in addr;
+        socklen_t len = sizeof addr;
+        sigset_t hup;
+        pthread_t thread_id;
+        int n = *shard_count < SHARDS_MAX ? *shard_count : SHARDS_MAX;
+        int status;
+        int fd;
+
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        assert(getsockname(sockfd, (struct sockaddr *) &addr, &len) == 0);
+        shards[0].fd = sockfd;
+
+        /* Only now: serve_listen() bound SOCKFD without it, so a port
+         * in use by another daemon was skipped, not shared */
+        if (n > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int) { 1 }, sizeof(int)) < 0) {
+                LOG("SO_REUSEPORT: %s\n", strerror(errno));
+                n = 1;
+        }
+
+        for (int k = 1; k < n; k++) {
+                if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int) { 1 }, sizeof(int)) < 0 ||
+                    bind(fd, (struct sockaddr *) &addr, len) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+                        LOG("Shard %d: %s\n", k, strerror(errno));
+                        if (fd >= 0)
+                                close(fd);
+                        break;
+                }
+                shards[k].fd = fd;
+                pthread_sigmask(SIG_BLOCK, &hup, NULL);
+                status = pthread_create(&thread_id, NULL, serve_shard_loop, &shards[k]);
+                pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+                if (status != 0) {
+                        LOG("pthread_create: %s\n", strerror(status));
+                        close(fd);
+                        break;
+                }
+                pthread_detach(thread_id);
+                nshards = k + 1;
+        }
+        serve_shard_loop(&shards[0]);
+}
+
+static void
+serve_loop(int sockfd)
+{
+        struct sockaddr_in sock_in;
+        struct serve_data *sdata;
+        struct sigaction sa = { .sa_handler = on_sighup };
+        sigset_t hup;
+        pthread_t thread_id;
+        socklen_t addr_len;
+        int clientfd;
+        int status;
+        uint64_t start;
+
+        /* A client closing early must not kill the daemon */
+        signal(SIGPIPE, SIG_IGN);
+
+        /* Without SA_RESTART SIGHUP interrupts accept(). Response threads
+         * block it so it is always delivered to this one. */
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        sigaction(SIGHUP, &sa, NULL);
+
+        pthread_sigmask(SIG_BLOCK, &hup, NULL);
+        if ((status = pthread_create(&thread_id, NULL, serve_watch, NULL)) == 0)
+                pthread_detach(thread_id);
+        else
+                LOG("pthread_create: %s\n", strerror(status));
+        pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+
+        if (shard_count && *shard_count > 1)
+                serve_shards(sockfd);
+        else if (uring && *uring) {
+                /* A single thread, it can keep pages until it falls back */
+                render_cache_attach();
+                serve_uring(sockfd);
+                render_cache_detach();
+        }
+
+        while (1) {
+                addr_len = sizeof(struct sockaddr_in);
+                if (reload_requested)
+                        serve_reload();
+                start = monotonic_us();
+
+                if (((clientfd = accept(sockfd, (struct sockaddr *) &sock_in, &addr_len)) < 0)) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG("accept: %s\n", strerror(errno));
+                        break;
+                }
+                TRACE_END("request/accept", start);
+
+                sdata = malloc(sizeof *sdata);
+                assert(sdata);
+                *sdata = (struct serve_data) {
+                        .sock_in = sock_in,
+                        .clientfd = clientfd,
+                        .addr_len = addr_len,
+                };
+
+                pthread_sigmask(SIG_BLOCK, &hup, NULL);
+                status = pthread_create(&thread_id, NULL, serve_gen_response, sdata);
+                pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+                if (status != 0) {
+                        LOG("pthread_create: %s\n", strerror(status));
+                        break;
+                } else
+                        pthread_detach(thread_id);
+        }
+        /* Really it never reaches this */
+        close(sockfd);
+        UNREACHABLE("out of daemon loop");
+}
+
+static void
+spawn_serve()
+{
+        static int port = PORT;
+        int sockfd;
+
+        /* As fork is called twice it is not attacked to terminal */
+        if (fork() != 0) {
+                exit(0);
+        }
+
+        if (fork() != 0) {
+                exit(0);
+        }
+
+        kill_self();
+
+        /* CLI calls read the tasks from here while the daemon runs */
+        shm_create();
+        source_sync(*in_file);
+        shm_publish();
+
+        sockfd = serve_listen(INADDR_ANY, &port);
+
+        /* Show the address before close descriptors so it can be redirected
+         * Example: ~$ firefox $(todo -serve)
+         * It should open a client in the browser */
+        printf("http://127.0.0.1:%d\n", port);
+
+        /* Man page of close said that it flushes descriptors, but I need to
+         * do this to be able to redirect output to browser without errors */
+        fflush(stdout);
+        fflush(stderr);
+
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+
+        /* Open logfile at stdin and stdout */
+        assert(open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND, 0600) >= 0);
+        assert(open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND, 0600) >= 0);
+
+        close(STDIN_FILENO);
+
+        serve_loop(sockfd);
+}
+
+/* ---------- Load generator (-bench-serve) ---------- */
+
+enum {
+        BENCH_LIST = 0,
+        BENCH_DONE,
+        BENCH_SAVE,
+        BENCH_KINDS,
+};
+
+static const char *bench_kind_names[BENCH_KINDS] = { "list", "done", "save" };
+static const char *bench_kind_requests[BENCH_KINDS] = {
+        "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+        "GET /?button=0 HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+        "GET /?button=-1 HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+};
+
+typedef DA(uint32_t) Latency_da;
+
+struct bench_client {
+        pthread_t thread_id;
+        int port;
+        int requests;
+        int mix[BENCH_KINDS]; /* cumulative weights */
+        unsigned int seed;
+        Latency_da latency[BENCH_KINDS]; /* microseconds */
+        int errors;
+};
+
+/* One request on a new connection, as the daemon closes after
+ * each response. Returns 0 on success. */
+static int
+bench_request(int port, const char *req)
+{
+        struct sockaddr_in sock_in = { 0 };
+        char buf[16 * 1024];
+        ssize_t n;
+        size_t total = 0;
+        int fd;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+                return -1;
+
+        sock_in.sin_family = AF_INET;
+        sock_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sock_in.sin_port = htons(port);
+
+        if (connect(fd, (struct sockaddr *) &sock_in, sizeof sock_in) < 0 ||
+            write(fd, req, strlen(req)) != (ssize_t) strlen(req)) {
+                close(fd);
+                return -1;
+        }
+
+        while ((n = read(fd, buf, sizeof buf)) > 0)
+                total += n;
+
+        close(fd);
+        return (n < 0 || total == 0) ? -1 : 0;
+}
+
+static void *
+bench_client_thread(void *args)
+{
+        struct bench_client *c = args;
+        uint64_t start;
+        int kind;
+        int r;
+
+        for (int i = 0; i < c->requests; i++) {
+                r = rand_r(&c->seed) % c->mix[BENCH_KINDS - 1];
+                for (kind = 0; r >= c->mix[kind]; kind++) {
+                }
+
+                start = monotonic_us();
+                if (bench_request(c->port, bench_kind_requests[kind]) < 0) {
+                        ++c->errors;
+                        continue;
+                }
+                da_append(&c->latency[kind], (uint32_t) (monotonic_us() - start));
+        }
+        return NULL;
+}
+
+/* Resident set size of PID in KiB, or -1 */
+static long
+rss_kib(pid_t pid)
+{
+        char path[64];
+        long pages = -1;
+        FILE *f;
+
+        snprintf(path, sizeof path, "/proc/%d/statm", (int) pid);
+        if ((f = fopen(path, "r")) == NULL)
+                return -1;
+        if (fscanf(f, "%*s %ld", &pages) != 1)
+                pages = -1;
+        fclose(f);
+        return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+struct bench_sampler {
+        pthread_t thread_id;
+        pid_t pid;
+        uint64_t start;
+        volatile bool stop;
+};
+
+static void *
+bench_sampler_thread(void *args)
+{
+        struct bench_sampler *s = args;
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+
+        while (!s->stop) {
+                printf("{\"bench\":\"serve/rss\",\"t_ms\":%" PRIu64 ",\"rss_kib\":%ld}\n",
+                       (monotonic_us() - s->start) / 1000, rss_kib(s->pid));
+                fflush(stdout);
+                nanosleep(&ts, NULL);
+        }
+        return NULL;
+}
+
+static void
+bench_print_latency(const char *name, Latency_da *l, uint64_t elapsed_us)
+{
+        if (l->size == 0)
+                return;
+
+        qsort(l->data, l->size, sizeof *l->data, compare_u32);
+        printf("{\"bench\":\"serve/%s\",\"requests\":%d,\"req_per_s\":%.1f,"
+               "\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"max_us\":%u}\n",
+               name, l->size, l->size * 1e6 / elapsed_us,
+               l->data[l->size / 2], l->data[l->size * 90 / 100],
+               l->data[l->size * 99 / 100], l->data[l->size - 1]);
+}
+
+/* Fill DATA with N synthetic tasks around the current date */
+static void
+bench_seed(int n)
+{
+        time_t now = time(NULL);
+        char buf[64];
+
+        for (int i = 0; i < n; i++) {
+                Task task = { 0 };
+                snprintf(buf, sizeof buf, "Task %d", i);
+                task.name = strdup(buf);
+                if (i % 2) {
+                        snprintf(buf, sizeof buf, "Synthetic description %d", i);
+                        task.desc = strdup(buf);
+                }
+                task.due = now - 30 * 3600 * 24 + rand() % (90 * 3600 * 24);
+                store_append(&data, task);
+        }
+        store_sort(&data);
+}
+
+/* Start the daemon loop in a child bound to loopback and drive it with
+ * CONNS concurrent clients issuing REQUESTS requests following MIX,
+ * given as "list:done:save" weights. Results are printed as JSON lines. */
+static void
+bench_serve(int conns, int requests, const char *mix)
+{
+        struct bench_client *clients;
+        struct bench_sampler sampler = { 0 };
+        Latency_da all[BENCH_KINDS + 1] = { 0 };
+        int weights[BENCH_KINDS] = { 0 };
+        int port = PORT;
+        int errors = 0;
+        int pipefd[2];
+        uint64_t elapsed;
+        pid_t pid;
+        int sockfd;
+
+        if (sscanf(mix, "%d:%d:%d", &weights[BENCH_LIST], &weights[BENCH_DONE], &weights[BENCH_SAVE]) != 3 ||
+            weights[BENCH_LIST] + weights[BENCH_DONE] + weights[BENCH_SAVE] <= 0 || conns <= 0) {
+                LOG("Error: invalid bench mix '%s' (expected list:done:save)\n", mix);
+                return;
+        }
+
+        assert(pipe(pipefd) == 0);
+        if ((pid = fork()) == 0) {
+                close(pipefd[0]);
+                sockfd = serve_listen(INADDR_LOOPBACK, &port);
+                assert(write(pipefd[1], &port, sizeof port) == sizeof port);
+                close(pipefd[1]);
+                serve_loop(sockfd);
+        }
+        close(pipefd[1]);
+        assert(read(pipefd[0], &port, sizeof port) == sizeof port);
+        close(pipefd[0]);
+
+        sampler.pid = pid;
+        sampler.start = monotonic_us();
+        assert(pthread_create(&sampler.thread_id, NULL, bench_sampler_thread, &sampler) == 0);
+
+        clients = calloc(conns, sizeof *clients);
+        assert(clients);
+        for (int i = 0; i < conns; i++) {
+                clients[i].port = port;
+                clients[i].requests = requests / conns + (i < requests % conns);
+                clients[i].seed = i + 1;
+                for (int k = 0; k < BENCH_KINDS; k++)
+                        clients[i].mix[k] = weights[k] + (k ? clients[i].mix[k - 1] : 0);
+                assert(pthread_create(&clients[i].thread_id, NULL, bench_client_thread, &clients[i]) == 0);
+        }
+
+        for (int i = 0; i < conns; i++) {
+                pthread_join(clients[i].thread_id, NULL);
+                errors += clients[i].errors;
+                for (int k = 0; k < BENCH_KINDS; k++) {
+                        for_da_each(l, clients[i].latency[k])
+                        {
+                                da_append(&all[k], *l);
+                                da_append(&all[BENCH_KINDS], *l);
+                        }
+                        da_destroy(&clients[i].latency[k]);
+                }
+        }
+        elapsed = monotonic_us() - sampler.start;
+
+        sampler.stop = true;
+        pthread_join(sampler.thread_id, NULL);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+
+        for (int k = 0; k < BENCH_KINDS; k++)
+                bench_print_latency(bench_kind_names[k], &all[k], elapsed);
+        bench_print_latency("all", &all[BENCH_KINDS], elapsed);
+        printf("{\"bench\":\"serve/summary\",\"conns\":%d,\"requests\":%d,"
+               "\"errors\":%d,\"elapsed_us\":%" PRIu64 "}\n",
+               conns, all[BENCH_KINDS].size, errors, elapsed);
+
+        for (int k = 0; k <= BENCH_KINDS; k++)
+                da_destroy(&all[k]);
+        free(clients);
+}
+
+/* Thread safe, the acceptors call it for their ETags */
+static time_t
+days(unsigned int days)
+{
+        time_t t;
+        struct tm tm;
+        t = time(NULL) + days * (3600 * 24);
+        localtime_r(&t, &tm);
+        tm.tm_hour = 23;
+        tm.tm_min = 59;
+        tm.tm_sec = 59;
+        tm.tm_isdst = -1; // determine if summer time is in use (+-1h)
+        return mktime(&tm);
+}
+
+static time_t
+next_sunday(int *d)
+{
+        time_t t;
+        struct tm *tp;
+        t = time(NULL);
+        tp = localtime(&t);
+        tp->tm_isdst = -1; // determine if summer time is in use (+-1h)
+        mktime(tp);
+        if (d)
+                *d = 7 - tp->tm_wday;
+        return days(7 - tp->tm_wday);
+}
+
+/* End of the last day of this month */
+static time_t
+end_of_month()
+{
+        time_t t;
+        struct tm *tp;
+        t = time(NULL);
+        tp = localtime(&t);
+        tp->tm_mon += 1;
+        tp->tm_mday = 0; // day 0 of next month is the last of this one
+        tp->tm_hour = 23;
+        tp->tm_min = 59;
+        tp->tm_sec = 59;
+        tp->tm_isdst = -1; // determine if summer time is in use (+-1h)
+        return mktime(tp);
+}
+
+/* Tasks of DATA (and occurrences of repeating ones) due in [LO, HI] */
+static Task_view
+tasks_between(time_t lo, time_t hi)
+{
+        uint64_t start = monotonic_us();
+        Task_view v = select_due_between(&data, TIME_MIN, hi);
+        int n = 0;
+
+        v = view_expand(&data, v, lo, hi);
+        if (lo != TIME_MIN) {
+                for (int i = 0; i < v.size; i++) {
+                        if (view_due(&data, v, i) < lo)
+                                continue;
+                        if (v.due)
+                                v.due[n] = v.due[i];
+                        v.rows[n++] = v.rows[i];
+                }
+                v.size = n;
+        }
+        TRACE_END("filter", start);
+        return v;
+}
 
-        sem_post(sem);
+/* Get the rows of DATA whose end date is before TP */
+static Task_view
+tasks_before(struct tm tp)
+{
+        tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
+        return tasks_between(TIME_MIN, mktime(&tp));
 }
 
-/* Shared info between serve loop and serve_gen_response thread */
-struct serve_data {
-        struct sockaddr_in sock_in;
-        int clientfd;
-        int addr_len;
-};
+/* ---------- Filter expressions (-filter) ---------- */
 
-static void *
-serve_gen_response(void *args)
-{
-        struct serve_data sdata = *(struct serve_data *) args;
-        char buf[BUFSIZE];
-        char css_file_buf[1024];
-        int clicked_elem_index;
-        int fd;
-        int n;
+/* Queries like
+ *     due < +3d and (desc ~ "deploy" or name ~ deploy)
+ * are compiled once into a postfix program. Conditions:
+ *     due < | <= | > | >= TIME
+ *     name | desc | text ~ | = WORD   (~ contains, ignoring case;
+ *                                      text is name or desc)
+ *     tag | project = WORD
+ * joined with and, or, not and parentheses. TIME is now, today, sunday,
+ * DD/MM/YYYY (end of that day), +Nd (end of the day N days from today,
+ * like -in N), +Nh (N hours from now) or -Nd / -Nh (in the past).
+ * While compiling, the due conditions that every match must satisfy are
+ * folded into [lo, hi], so only that slice of the sorted store is run
+ * through the program. */
 
-        if (sdata.clientfd < 0) {
-                LOG("invalid clientfd\n");
-                return NULL;
-        }
+typedef enum {
+        FILTER_DUE_LT = 0,
+        FILTER_DUE_LE,
+        FILTER_DUE_GT,
+        FILTER_DUE_GE,
+        FILTER_NAME_HAS,
+        FILTER_DESC_HAS,
+        FILTER_TEXT_HAS,
+        FILTER_NAME_EQ,
+        FILTER_DESC_EQ,
+        FILTER_TEXT_EQ,
+        FILTER_TAG,
+        FILTER_PROJECT,
+        FILTER_AND,
+        FILTER_OR,
+        FILTER_NOT,
+} Filter_op;
 
-        switch (read(sdata.clientfd, buf, sizeof buf - 1)) {
-        default:
-                if (sscanf(buf, "GET /?button=%d HTTP/1.1", &clicked_elem_index) == 1) {
-                        switch (clicked_elem_index) {
-                        default:
-                                /* Buttons from 0 to tasks num - 1 */
-                                da_remove(&data, clicked_elem_index);
-                                break;
-                        case -1:
-                                /* Save button */
-                                load_to_file(*out_file);
-                                break;
-                        }
-                        break;
-                }
-                if (strncmp(buf, "GET /favicon.ico HTTP/1.1", 25) == 0) {
-                        /* The client ask for the icon. As it is not needed,
-                         * return and dont send anything to the client. */
-                        return NULL;
-                }
-                break;
+typedef struct {
+        Filter_op op;
+        time_t time;
+        char *str;
+        uint32_t sym; /* tag or project, UINT32_MAX if unknown */
+} Filter_insn;
 
-        case 0:
-        case -1:
-                LOG("Internal Server Error! Reload the page\n");
-                return NULL;
-        }
+typedef DA(Filter_insn) Filter;
 
-        qsort(data.data, data.size, sizeof *data.data, compare_tasks_by_date);
+/* Parser state */
+struct filter_parser {
+        const char *c;
+        Filter *prog;
+        char error[128];
+};
 
-        *buf = 0; // set buf size to 0
+/* Due dates every match of a subexpression is within */
+struct due_range {
+        time_t lo;
+        time_t hi;
+};
 
-        /* ---------- INLINE HTML ---------- */
+#define DUE_ANY ((struct due_range) { TIME_MIN, TIME_MAX })
 
-        strcatf(buf, "<!DOCTYPE html>");
-        strcatf(buf, "<html>");
-        strcatf(buf, "<head>");
+static struct due_range filter_parse_or(struct filter_parser *p);
 
-        /* Try to open and load CSS file directly into <style> ... </style>. */
-        fd = open(*css_file, O_RDONLY);
-        if (fd >= 0) {
-                strcatf(buf, "<style>");
-                while ((n = read(fd, css_file_buf, sizeof css_file_buf - 1)) > 0) {
-                        css_file_buf[n] = 0;
-                        strcatf(buf, "%s", css_file_buf);
-                }
-                close(fd);
-                strcatf(buf, "</style>");
-        } else
-                LOG("Error: cant load css file '%s'\n", *css_file);
+static void
+filter_skip_spaces(struct filter_parser *p)
+{
+        while (isspace((unsigned char) *p->c))
+                ++p->c;
+}
 
-        strcatf(buf, "</head>");
-        strcatf(buf, "<body>");
-        strcatf(buf, "<title>");
-        strcatf(buf, "Todo");
-        strcatf(buf, "</title>");
-        strcatf(buf, "<h1>");
-        strcatf(buf, "Tasks");
-        strcatf(buf, "</h1>");
-        strcatf(buf, "<dl>");
-
-        for_da_each(e, data)
-        {
-                strcatf(buf, "<dt>");
-                strcatf(buf, "%s", e->name);
-                strcatf(buf, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
-                strcatf(buf, "<input type=\"hidden\" name=\"button\" value=\"%d\">", da_index(e, data));
-                strcatf(buf, "<button type=\"submit\">Done</button>");
-                strcatf(buf, "</form>");
-                strcatf(buf, "<dd>");
-                strcatf(buf, "%s", overload_date(e->due));
-                strcatf(buf, "</dd>");
-                if (e->desc) {
-                        strcatf(buf, "<dd><p>");
-                        strcatf(buf, "%s\n", e->desc);
-                        strcatf(buf, "</p></dd>");
-                }
-        }
-
-        strcatf(buf, "</dl>");
-        strcatf(buf, "<br>");
-        strcatf(buf, "<form action=\"/\" method=\"GET\" style=\"display:inline;\">");
-        strcatf(buf, "<input type=\"hidden\" name=\"button\" value=\"%d\">", -1);
-        strcatf(buf, "<button type=\"submit\">Save</button>");
-        strcatf(buf, "</form>");
-        strcatf(buf, "</body>");
-        strcatf(buf, "</html>");
-
-        dprintf(sdata.clientfd, "HTTP/1.1 200 OK\r\n");
-        dprintf(sdata.clientfd, "Content-Type: text/html\r\n");
-        dprintf(sdata.clientfd, "Content-Length: %zu\r\n", strlen(buf));
-        dprintf(sdata.clientfd, "\r\n");
-
-        assert(send(sdata.clientfd, buf, strlen(buf), 0) > 0);
-
-        close(sdata.clientfd);
-        return 0;
+/* Consume WORD if it is the next token */
+static bool
+filter_accept(struct filter_parser *p, const char *word)
+{
+        size_t n = strlen(word);
+        filter_skip_spaces(p);
+        if (strncmp(p->c, word, n) != 0)
+                return false;
+        /* Keywords must not be the prefix of a longer word */
+        if (isalpha((unsigned char) word[0]) && isalnum((unsigned char) p->c[n]))
+                return false;
+        p->c += n;
+        return true;
 }
 
 static void
-spawn_serve()
+filter_error(struct filter_parser *p, const char *msg)
 {
-        static int port = PORT;
-        struct sockaddr_in sock_in;
-        pthread_t thread_id;
-        socklen_t addr_len;
-        int sockfd;
-        int clientfd;
-        int status;
+        if (!*p->error)
+                snprintf(p->error, sizeof p->error, "%s at '%.20s'", msg, p->c);
+}
 
-        /* As fork is called twice it is not attacked to terminal */
-        if (fork() != 0) {
-                exit(0);
-        }
+/* A quoted string or a bare word, returned as a new string */
+static char *
+filter_parse_word(struct filter_parser *p)
+{
+        const char *start;
+        char *word;
+        size_t n;
 
-        if (fork() != 0) {
-                exit(0);
+        filter_skip_spaces(p);
+        if (*p->c == '"') {
+                start = ++p->c;
+                while (*p->c && *p->c != '"')
+                        ++p->c;
+                if (!*p->c) {
+                        filter_error(p, "unterminated string");
+                        return NULL;
+                }
+                n = p->c++ - start;
+        } else {
+                start = p->c;
+                while (*p->c && !isspace((unsigned char) *p->c) && *p->c != ')')
+                        ++p->c;
+                n = p->c - start;
+        }
+        if (n == 0 && *start != '"') {
+                filter_error(p, "expected a word");
+                return NULL;
         }
+        word = malloc(n + 1);
+        assert(word);
+        memcpy(word, start, n);
+        word[n] = 0;
+        return word;
+}
 
-        kill_self();
+static bool
+filter_parse_time(struct filter_parser *p, time_t *t)
+{
+        struct tm tp = { 0 };
+        char unit;
+        int n;
+        int len;
 
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        assert(sockfd >= 0);
+        filter_skip_spaces(p);
+        if (filter_accept(p, "now"))
+                *t = time(NULL);
+        else if (filter_accept(p, "today"))
+                *t = days(0);
+        else if (filter_accept(p, "sunday"))
+                *t = next_sunday(NULL);
+        else if (sscanf(p->c, "%d/%d/%d%n", &tp.tm_mday, &tp.tm_mon, &tp.tm_year, &len) == 3) {
+                tp.tm_mon -= 1;
+                tp.tm_year -= 1900;
+                tp.tm_hour = 23;
+                tp.tm_min = 59;
+                tp.tm_sec = 59;
+                tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
+                *t = mktime(&tp);
+                p->c += len;
+        } else if ((*p->c == '+' || *p->c == '-') &&
+                   sscanf(p->c + 1, "%d%c%n", &n, &unit, &len) == 2 && (unit == 'd' || unit == 'h')) {
+                if (*p->c == '+' && unit == 'd')
+                        *t = days(n);
+                else
+                        *t = time(NULL) + (*p->c == '+' ? 1 : -1) * n * (unit == 'd' ? 3600 * 24 : 3600);
+                p->c += len + 1;
+        } else {
+                filter_error(p, "expected a time");
+                return false;
+        }
+        return true;
+}
 
-        sock_in.sin_family = AF_INET;
-        sock_in.sin_addr.s_addr = htonl(INADDR_ANY);
+static struct due_range
+filter_parse_cond(struct filter_parser *p)
+{
+        Filter_insn insn = { 0 };
+        struct due_range r = DUE_ANY;
+        int field;
 
-retry:
-        errno = 0;
-        sock_in.sin_port = htons(port);
+        if (filter_accept(p, "due")) {
+                if (filter_accept(p, "<="))
+                        insn.op = FILTER_DUE_LE;
+                else if (filter_accept(p, "<"))
+                        insn.op = FILTER_DUE_LT;
+                else if (filter_accept(p, ">="))
+                        insn.op = FILTER_DUE_GE;
+                else if (filter_accept(p, ">"))
+                        insn.op = FILTER_DUE_GT;
+                else {
+                        filter_error(p, "expected <, <=, > or >=");
+                        return r;
+                }
+                if (!filter_parse_time(p, &insn.time))
+                        return r;
+                switch (insn.op) {
+                case FILTER_DUE_LT:
+                        r.hi = insn.time - 1;
+                        break;
+                case FILTER_DUE_LE:
+                        r.hi = insn.time;
+                        break;
+                case FILTER_DUE_GT:
+                        r.lo = insn.time + 1;
+                        break;
+                default:
+                        r.lo = insn.time;
+                        break;
+                }
+                da_append(p->prog, insn);
+                return r;
+        }
 
-        if (bind(sockfd, (struct sockaddr *) &sock_in, sizeof(struct sockaddr_in)) < 0) {
-                if (errno == EADDRINUSE) {
-                        ++port;
-                        if (port - PORT > MAX_ATTEMPTS) {
-                                perror("Bind max attempts");
-                                exit(1);
-                        }
-                        goto retry;
+        if (filter_accept(p, "tag") || filter_accept(p, "project")) {
+                insn.op = p->c[-1] == 'g' ? FILTER_TAG : FILTER_PROJECT;
+                if (!filter_accept(p, "=")) {
+                        filter_error(p, "expected =");
+                        return r;
                 }
-                perror("Bind");
-                exit(1);
+                if ((insn.str = filter_parse_word(p)) == NULL)
+                        return r;
+                if ((insn.sym = intern(insn.str, false)) == 0)
+                        insn.sym = UINT32_MAX;
+                da_append(p->prog, insn);
+                return r;
         }
 
-        assert(listen(sockfd, MAX_CLIENTS) >= 0);
+        if (filter_accept(p, "name"))
+                field = 0;
+        else if (filter_accept(p, "desc"))
+                field = 1;
+        else if (filter_accept(p, "text"))
+                field = 2;
+        else {
+                filter_error(p, "expected due, name, desc, text, tag or project");
+                return r;
+        }
 
-        /* Show the address before close descriptors so it can be redirected
-         * Example: ~$ firefox $(todo -serve)
-         * It should open a client in the browser */
-        printf("http://127.0.0.1:%d\n", port);
+        if (filter_accept(p, "~"))
+                insn.op = FILTER_NAME_HAS + field;
+        else if (filter_accept(p, "="))
+                insn.op = FILTER_NAME_EQ + field;
+        else {
+                filter_error(p, "expected ~ or =");
+                return r;
+        }
+        if ((insn.str = filter_parse_word(p)) != NULL)
+                da_append(p->prog, insn);
+        return r;
+}
 
-        /* Man page of close said that it flushes descriptors, but I need to
-         * do this to be able to redirect output to browser without errors */
-        fflush(stdout);
-        fflush(stderr);
+static struct due_range
+filter_parse_unary(struct filter_parser *p)
+{
+        struct due_range r;
 
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
+        if (filter_accept(p, "not")) {
+                filter_parse_unary(p);
+                da_append(p->prog, (Filter_insn) { .op = FILTER_NOT });
+                return DUE_ANY;
+        }
+        if (filter_accept(p, "(")) {
+                r = filter_parse_or(p);
+                if (!filter_accept(p, ")"))
+                        filter_error(p, "expected )");
+                return r;
+        }
+        return filter_parse_cond(p);
+}
 
-        /* Open logfile at stdin and stdout */
-        assert(open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND, 0600) >= 0);
-        assert(open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND, 0600) >= 0);
+static struct due_range
+filter_parse_and(struct filter_parser *p)
+{
+        struct due_range r = filter_parse_unary(p);
+        struct due_range r2;
 
-        close(STDIN_FILENO);
+        while (!*p->error && filter_accept(p, "and")) {
+                r2 = filter_parse_unary(p);
+                da_append(p->prog, (Filter_insn) { .op = FILTER_AND });
+                r.lo = r2.lo > r.lo ? r2.lo : r.lo;
+                r.hi = r2.hi < r.hi ? r2.hi : r.hi;
+        }
+        return r;
+}
 
-        while (1) {
-                addr_len = sizeof(struct sockaddr_in);
+static struct due_range
+filter_parse_or(struct filter_parser *p)
+{
+        struct due_range r = filter_parse_and(p);
+        struct due_range r2;
 
-                if (((clientfd = accept(sockfd, (struct sockaddr *) &sock_in, &addr_len)) < 0)) {
-                        LOG("accept: %s\n", strerror(errno));
-                        break;
-                }
+        while (!*p->error && filter_accept(p, "or")) {
+                r2 = filter_parse_and(p);
+                da_append(p->prog, (Filter_insn) { .op = FILTER_OR });
+                r.lo = r2.lo < r.lo ? r2.lo : r.lo;
+                r.hi = r2.hi > r.hi ? r2.hi : r.hi;
+        }
+        return r;
+}
 
-                struct serve_data sdata = (struct serve_data) {
-                        .sock_in = sock_in,
-                        .clientfd = clientfd,
-                        .addr_len = addr_len,
-                };
+static void
+filter_destroy(Filter *prog)
+{
+        for_da_each(insn, *prog)
+        {
+                free(insn->str);
+        }
+        da_destroy(prog);
+}
 
-                if ((status = pthread_create(&thread_id, NULL, serve_gen_response, &sdata)) != 0) {
-                        LOG("pthread_create: %s\n", strerror(status));
-                        break;
-                } else
-                        pthread_detach(thread_id);
+/* Compile SRC into PROG. On error it returns false and ERROR (of
+ * size SIZE) says why. */
+static bool
+filter_compile(const char *src, Filter *prog, struct due_range *range, char *error, size_t size)
+{
+        struct filter_parser p = { .c = src, .prog = prog };
+
+        *range = filter_parse_or(&p);
+        filter_skip_spaces(&p);
+        if (*p.c)
+                filter_error(&p, "unexpected input");
+        if (*p.error) {
+                snprintf(error, size, "%s", p.error);
+                filter_destroy(prog);
+                return false;
         }
-        /* Really it never reaches this */
-        close(sockfd);
-        UNREACHABLE("out of daemon loop");
+        return true;
 }
 
-static time_t
-days(unsigned int days)
+static bool
+filter_run(const Filter *prog, Task_store *s, int row, bool *stack)
 {
-        time_t t;
-        struct tm *tp;
-        t = time(NULL) + days * (3600 * 24);
-        tp = localtime(&t);
-        tp->tm_hour = 23;
-        tp->tm_min = 59;
-        tp->tm_sec = 59;
-        tp->tm_isdst = -1; // determine if summer time is in use (+-1h)
-        return mktime(tp);
+        const Filter_insn *insn;
+        int top = 0;
+
+        for (insn = prog->data; insn < prog->data + prog->size; insn++) {
+                switch (insn->op) {
+                case FILTER_DUE_LT:
+                        stack[top++] = s->due[row] < insn->time;
+                        break;
+                case FILTER_DUE_LE:
+                        stack[top++] = s->due[row] <= insn->time;
+                        break;
+                case FILTER_DUE_GT:
+                        stack[top++] = s->due[row] > insn->time;
+                        break;
+                case FILTER_DUE_GE:
+                        stack[top++] = s->due[row] >= insn->time;
+                        break;
+                case FILTER_NAME_HAS:
+                        stack[top++] = contains_nocase(s->name[row], insn->str);
+                        break;
+                case FILTER_DESC_HAS:
+                        stack[top++] = contains_nocase(s->desc[row], insn->str);
+                        break;
+                case FILTER_TEXT_HAS:
+                        stack[top++] = contains_nocase(s->name[row], insn->str) ||
+                                       contains_nocase(s->desc[row], insn->str);
+                        break;
+                case FILTER_NAME_EQ:
+                        stack[top++] = strcmp(s->name[row], insn->str) == 0;
+                        break;
+                case FILTER_DESC_EQ:
+                        stack[top++] = s->desc[row] && strcmp(s->desc[row], insn->str) == 0;
+                        break;
+                case FILTER_TEXT_EQ:
+                        stack[top++] = strcmp(s->name[row], insn->str) == 0 ||
+                                       (s->desc[row] && strcmp(s->desc[row], insn->str) == 0);
+                        break;
+                case FILTER_TAG:
+                        stack[top++] = has_tag(s->tags[row], insn->sym);
+                        break;
+                case FILTER_PROJECT:
+                        stack[top++] = s->project[row] == insn->sym;
+                        break;
+                case FILTER_AND:
+                        --top;
+                        stack[top - 1] = stack[top - 1] && stack[top];
+                        break;
+                case FILTER_OR:
+                        --top;
+                        stack[top - 1] = stack[top - 1] || stack[top];
+                        break;
+                case FILTER_NOT:
+                        stack[top - 1] = !stack[top - 1];
+                        break;
+                }
+        }
+        return top == 1 && stack[0];
 }
 
-static time_t
-next_sunday(int *d)
+/* First row whose due date is not before DUE */
+static int
+store_lower_bound(Task_store *s, time_t due)
 {
-        time_t t;
-        struct tm *tp;
-        t = time(NULL);
-        tp = localtime(&t);
-        tp->tm_isdst = -1; // determine if summer time is in use (+-1h)
-        mktime(tp);
-        if (d)
-                *d = 7 - tp->tm_wday;
-        return days(7 - tp->tm_wday);
+        return due == TIME_MIN ? 0 : store_upper_bound(s, due - 1);
 }
 
-/* Get a subarray of DATA whose end date is before TP */
-static Task_da
-tasks_before(struct tm tp)
+/* Rows of S matching PROG. Only rows inside RANGE are evaluated. */
+static Task_view
+filter_select(Task_store *s, const Filter *prog, struct due_range range)
 {
-        tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
-        time_t time = mktime(&tp);
-        Task_da filtered_data = { 0 };
+        uint64_t start = monotonic_us();
+        Task_view v = { 0 };
+        bool *stack;
+        int lo = 0;
+        int hi = 0;
 
-        for_da_each(task, data)
-        {
-                if (difftime(task->due, time) <= 0)
-                        da_append(&filtered_data, *task);
+        if (range.lo <= range.hi) {
+                lo = store_lower_bound(s, range.lo);
+                hi = store_upper_bound(s, range.hi);
         }
-        return filtered_data;
+        v.rows = malloc((hi - lo + 1) * sizeof(int));
+        stack = malloc((prog->size + 1) * sizeof *stack);
+        assert(v.rows && stack);
+
+        for (int row = lo; row < hi; row++)
+                if (filter_run(prog, s, row, stack))
+                        v.rows[v.size++] = row;
+
+        free(stack);
+        TRACE_END("filter", start);
+        return v;
 }
 
 static void
 destroy_all()
 {
-        for_da_each(e, data)
-        {
-                free(e->name);
-                free(e->desc);
-        }
-        da_destroy(&data);
+        store_destroy(&data);
+        archived_destroy(&archive_pending);
+        ob_destroy(&undo_pending.records);
+        undo_log_destroy(&undo_unsaved);
+        symbols_destroy();
 }
 
 static void
@@ -538,6 +6965,27 @@ add_task()
                 task.desc = strdup(buf);
         }
 
+        /* Repeat */
+        printf("  Repeat (daily, weekly, monthly, N days, N months or empty): ");
+        fflush(stdout);
+        if (fgets(buf, sizeof buf - 1, stdin)[1] && !parse_every(buf, &task.every)) {
+                LOG("Error: can not parse repeat: %s\n", buf);
+                task_free(task);
+                return;
+        }
+
+        /* Project and tags */
+        printf("  Project (or empty): ");
+        fflush(stdout);
+        if (fgets(buf, sizeof buf - 1, stdin)[1]) {
+                TRUNCAT(buf, '\n');
+                task.project = intern(buf, true);
+        }
+        printf("  Tags (comma separated or empty): ");
+        fflush(stdout);
+        if (fgets(buf, sizeof buf - 1, stdin)[1])
+                task.tags = parse_tags(buf, true);
+
         /* Date */
         printf("  | +N: N days from today\n");
         printf("  | DD: Day DD of current month\n");
@@ -559,8 +7007,7 @@ add_task()
 
         } else {
                 LOG("Error: can not parse date: %s\n", buf);
-                free(task.name);
-                free(task.desc);
+                task_free(task);
                 return;
         }
 
@@ -589,27 +7036,54 @@ add_task()
         tp.tm_isdst = -1; // determine if summer time is in use (+-1h)
         task.due = mktime(&tp);
 
-        da_append(&data, task);
+        undo_record(UNDO_ADD, UNDO_INSERT, task);
+        store_insert(&data, task);
 }
 
-
+/* bench.c includes this file to reach the static functions above,
+ * so it has to be able to drop this main. */
+#ifndef TODO_NO_MAIN
 int
 main(int argc, char *argv[])
 {
+        uint64_t start = monotonic_us();
+        uint64_t parsed;
         bool *help = flag_bool("help", false, "Print this help and exit");
         bool *today = flag_bool("today", false, "Show tasks due today");
         bool *week = flag_bool("week", false, "Show tasks due this week (tasks before Sunday)");
+        bool *month = flag_bool("month", false, "Show tasks due this month");
         int *in = flag_int("in", -1, "Show tasks due in the next N days");
         bool *overdue = flag_bool("overdue", false, "Show tasks that are past their due date");
         int *done = flag_int("done", -1, "Mark task N as completed");
         bool *clear = flag_bool("clear", false, "Mark all tasks as completed");
         bool *add = flag_bool("add", false, "Add a new task");
-        char **in_file = flag_str("in_file", IN_FILENAME, "Input file");
+        in_file = flag_str("in_file", IN_FILENAME, "Input file");
         out_file = flag_str("out_file", IN_FILENAME, "Output file");
         css_file = flag_str("css_file", CSS_FILENAME, "CSS file");
         bool *serve = flag_bool("serve", false, "Start http server daemon");
         bool *die = flag_bool("die", false, "Kill running daemon");
+        uring = flag_bool("uring", false, "Serve with io_uring instead of a thread per request (Linux 5.19+)");
+        shard_count = flag_int("shards", 1, "Acceptor threads of the daemon, sharing its port (SO_REUSEPORT)");
+        bool *bench = flag_bool("bench-serve", false, "Benchmark the http server on a loopback port");
+        int *bench_conns = flag_int("bench-conns", 8, "Concurrent connections for -bench-serve");
+        int *bench_requests = flag_int("bench-requests", 10000, "Total requests for -bench-serve");
+        char **bench_mix = flag_str("bench-mix", "90:9:1", "Request weights list:done:save for -bench-serve");
+        int *bench_tasks = flag_int("bench-tasks", 1000, "Synthetic tasks served by -bench-serve");
         quiet = flag_bool("quiet", false, "Do not show unneded output");
+        char **filter_expr = flag_str("filter", NULL, "Show tasks matching an expression, e.g. 'due < +3d and desc ~ deploy'");
+        char **search = flag_str("search", NULL, "Show tasks whose name or description contains this text");
+        char **trace_file = flag_str("trace", NULL, "Write a Chrome trace (chrome://tracing) to this file");
+        char **tag = flag_str("tag", NULL, "Only show tasks with these tags (comma separated)");
+        char **project = flag_str("project", NULL, "Only show tasks of this project");
+        char **import_file = flag_str("import", NULL, "Add the tasks of a .ics (iCalendar) or CSV file, - for stdin");
+        archive_file = flag_str("archive_file", ARCHIVE_FILENAME, "Archive of done tasks");
+        undo_file = flag_str("undo_file", UNDO_FILENAME, "Undo log");
+        bool *undo_flag = flag_bool("undo", false, "Undo the last change (add, done, clear or import)");
+        bool *redo = flag_bool("redo", false, "Redo the last undone change");
+        int *finished = flag_int("finished", -1, "Show tasks done in the last N days (0 is today)");
+        char **export_file = flag_str("export", NULL, "Write all tasks to a .ics (iCalendar) or CSV file, - for stdout");
+        uint32_t *tag_filter = NULL;
+        uint32_t project_filter = 0;
 
         srand(time(0));
 
@@ -619,10 +7093,30 @@ main(int argc, char *argv[])
                 exit(1);
         }
 
-        if (load_from_file(*in_file) == 0) {
+        /* Spans before this point are emitted retroactively */
+        parsed = monotonic_us();
+        if (*trace_file) {
+                trace_open(*trace_file);
+                trace_event("flag_parse", start, parsed - start, NULL);
+        }
+
+        /* A running daemon already has the tasks loaded */
+        if ((*serve || *bench || *die || !shm_load(*in_file)) && load_from_file(*in_file) == 0) {
                 destroy_all();
+                trace_close();
                 exit(0);
         }
+        TRACE_END("startup", start);
+
+        /* The daemon answers /api/search, keep the index updated */
+        if (*search || *serve)
+                search_attach(&data);
+
+        /* Names are known after loading, unknown ones match nothing */
+        if (*tag)
+                tag_filter = parse_tags(*tag, false);
+        if (*project && (project_filter = intern(*project, false)) == 0)
+                project_filter = UINT32_MAX;
 
         /* The if(...) without else show tasks list.
          * The if(...) with else do not show default list tasks */
@@ -638,55 +7132,148 @@ main(int argc, char *argv[])
         }
 
         if (*done >= 0) {
-                qsort(data.data, data.size, sizeof *data.data, compare_tasks_by_date);
-                da_remove(&data, *done);
+                task_done(&data, *done);
         }
 
         if (*clear) {
-                data.size = 0;
+                for (int i = 0; i < data.size; i++) {
+                        archive_add(store_get(&data, i), time(NULL));
+                        undo_record(UNDO_CLEAR, UNDO_REMOVE, store_get(&data, i));
+                }
+                store_clear(&data);
+        }
+
+        if (*undo_flag) {
+                undo(&data, false);
+        }
+
+        if (*redo) {
+                undo(&data, true);
+        }
+
+        if (*import_file || *export_file) {
+                if (*import_file) {
+                        int n = import_tasks(*import_file);
+                        if (!*quiet)
+                                printf("Imported %d tasks from %s\n", n, *import_file);
+                }
+                if (*export_file) {
+                        int n = export_tasks(*export_file);
+                        if (n < 0)
+                                fprintf(stderr, "Can not write %s\n", *export_file);
+                        else if (!*quiet && strcmp(*export_file, "-"))
+                                printf("Exported %d tasks to %s\n", n, *export_file);
+                }
         }
 
-        if (*today) {
+        else if (*today) {
                 time_t time = days(0);
-                Task_da filter = tasks_before(*localtime(&time));
+                Task_view filter = tasks_before(*localtime(&time));
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
                 list_tasks(STDOUT_FILENO, filter, "Tasks for today");
+                view_destroy(&filter);
         }
 
         else if (*overdue) {
                 time_t t = time(NULL);
-                Task_da filter = tasks_before(*localtime(&t));
+                Task_view filter = tasks_before(*localtime(&t));
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
                 list_tasks(STDOUT_FILENO, filter, "Overdue tasks");
-                da_destroy(&filter);
+                view_destroy(&filter);
         }
 
         else if (*in >= 0) {
                 time_t time = days(*in);
-                Task_da filter = tasks_before(*localtime(&time));
+                Task_view filter = tasks_before(*localtime(&time));
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
                 list_tasks(STDOUT_FILENO, filter, "Tasks for %d days", *in);
-                da_destroy(&filter);
+                view_destroy(&filter);
         }
 
         else if (*week) {
                 time_t t = next_sunday(NULL);
-                Task_da filter = tasks_before(*localtime(&t));
+                Task_view filter = tasks_before(*localtime(&t));
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
                 list_tasks(STDOUT_FILENO, filter, "Tasks before Sunday");
-                da_destroy(&filter);
+                view_destroy(&filter);
+        }
+
+        else if (*month) {
+                time_t t = end_of_month();
+                Task_view filter = tasks_before(*localtime(&t));
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
+                list_tasks(STDOUT_FILENO, filter, "Tasks this month");
+                view_destroy(&filter);
+        }
+
+        else if (*filter_expr) {
+                Filter prog = { 0 };
+                struct due_range range;
+                char error[128];
+                if (!filter_compile(*filter_expr, &prog, &range, error, sizeof error)) {
+                        LOG("Error: -filter: %s\n", error);
+                } else {
+                        Task_view filter = filter_select(&data, &prog, range);
+                        view_filter_tags(&data, &filter, tag_filter, project_filter);
+                        list_tasks(STDOUT_FILENO, filter, "Tasks matching %s", *filter_expr);
+                        view_destroy(&filter);
+                        filter_destroy(&prog);
+                }
+        }
+
+        else if (*finished >= 0) {
+                list_finished(*finished);
+        }
+
+        else if (*search) {
+                Task_view filter = search_query(&data, *search);
+                view_filter_tags(&data, &filter, tag_filter, project_filter);
+                list_tasks(STDOUT_FILENO, filter, "Tasks matching \"%s\"", *search);
+                view_destroy(&filter);
         }
 
         else if (*serve) {
                 spawn_serve();
         }
 
+        else if (*bench) {
+                /* Do not touch the real task file */
+                destroy_all();
+                bench_seed(*bench_tasks);
+                *out_file = BENCH_FILENAME;
+                *archive_file = BENCH_ARCHIVE_FILENAME;
+                *undo_file = BENCH_UNDO_FILENAME;
+                bench_serve(*bench_conns, *bench_requests, *bench_mix);
+                unlink(BENCH_ARCHIVE_FILENAME);
+                unlink(BENCH_UNDO_FILENAME);
+        }
+
         else if (*die) {
                 kill_self();
                 sem_unlink("/todo_pid_file_sem");
+                shm_unlink(SHM_NAME);
         }
 
         else {
-                list_tasks(STDOUT_FILENO, data, "Tasks");
+                Task_view all = view_all(&data);
+                view_filter_tags(&data, &all, tag_filter, project_filter);
+                list_tasks(STDOUT_FILENO, all, "Tasks");
+                view_destroy(&all);
         }
 
-        load_to_file(*out_file);
+        if (archive_flush())
+                archive_compact();
+        undo_commit();
+        /* Queries have nothing to save */
+        if (data.dirty || strcmp(*in_file, *out_file) != 0) {
+                load_to_file(*out_file);
+                /* The daemon loads what was written */
+                if (strcmp(*in_file, *out_file) == 0)
+                        shm_notify(*in_file);
+        }
+        free(tag_filter);
         destroy_all();
+        trace_close();
         return 0;
 }
+#endif /* TODO_NO_MAIN */